@@ -28,13 +28,20 @@
 #include <string.h>
 #include <libintl.h>
 #include <locale.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <entry.h>
 #include <fat32.h>
 #include <analyze.h>
+#include <space.h>
 
 
-#define MAX_FILES 200000
+/** Number of bits in one word of a bitmap */
+#define AN_WORD_BITS (8 * sizeof(unsigned long))
+
+/** Initial size of aTable (in items); the table grows geometrically */
+#define AN_TABLE_INIT 1024
 
 /** Table with important informations about each item in all directory structure.
  * The items contain: starting cluster, the number of directory cluster, the number of the item
@@ -43,11 +50,34 @@
  */
 aTableItem* aTable = NULL;
 
+/** Starting clusters of the items in aTable. The fields that are used most often are kept in separate arrays
+  * (structure of arrays), so scans over them are cache friendly. */
+unsigned long *aStartCluster = NULL;
+
+/** Number of clusters of the items in aTable */
+unsigned long *aClusterCount = NULL;
+
+/** Index (in aTable) of the directory that contains the item; the root directory (index 0) is its own parent */
+unsigned long *aParent = NULL;
+
 /** Number of values in the table is equal to number of all files and directories that have
   * allocated almost 1 cluster
   */
 unsigned long tableCount = 0;
 
+/** Allocated size of aTable (in items) */
+unsigned long tableSize = 0;
+
+/** Pool of extents of all items in aTable; extents of a single item are stored one after other. The extents
+  * describe the disk as it was analysed (they are not updated during defragmentation). */
+anExtent *anExtents = NULL;
+
+/** Number of extents in the pool */
+unsigned long anExtentCount = 0;
+
+/** Allocated size of the pool (in extents); the pool grows geometrically */
+unsigned long anExtentSize = 0;
+
 /** Percentual disk fragmentation */
 float diskFragmentation;
 
@@ -57,10 +87,57 @@ unsigned long usedClusters;
 /** Number of items in single directory (variable value according to cluster size) */
 unsigned short an_entryCount;
 
+/** Number of threads that scan the directory tree (0 means number of online processors) */
+unsigned int an_jobs = 0;
+
+struct an_ScanTask;
+
+/** Directory item found by a scanning thread; it is moved into aTable when the scan is finished */
+typedef struct {
+  unsigned long startCluster;	/* starting cluster of the item */
+  unsigned long entryCluster;	/* directory cluster that links to the item */
+  unsigned long index;		/* index of the item in aTable (after the merge) */
+  unsigned long clusterCount;	/* number of clusters of the item */
+  unsigned long extentIndex;	/* index of the first extent of the item in extents of the task */
+  unsigned long extentCount;	/* number of extents of the item */
+  unsigned long modified;	/* date (high word) and time of the last modification */
+  float fragmentation;		/* percentual fragmentation of the item */
+  unsigned short entryIndex;	/* index of the item in directory cluster */
+  unsigned char isDir;		/* whether it is directory or file */
+  struct an_ScanTask *subdir;	/* task that scans the subdirectory (or NULL) */
+} an_ScanItem;
+
+/** Scan of a single directory; the task is run by any of the scanning threads */
+typedef struct an_ScanTask {
+  unsigned long startCluster;	/* first cluster of the directory */
+  an_ScanItem *items;		/* items found in the directory, in order of the directory entries */
+  unsigned long itemCount, itemSize;
+  anExtent *extents;		/* extents of the items */
+  unsigned long extentCount, extentSize;
+} an_ScanTask;
+
+/** Queue of tasks of one scanning thread. The owner takes the tasks from the tail (the last pushed one), other threads
+  * steal them from the head (so they take big subtrees). */
+typedef struct {
+  pthread_mutex_t lock;
+  an_ScanTask **tasks;
+  unsigned long head, tail, size;
+} an_TaskQueue;
+
+/** Queues of the scanning threads */
+static an_TaskQueue *an_queues = NULL;
+
+/** Number of tasks that are queued or are being scanned; the scan is finished when it drops to 0 */
+static volatile unsigned long an_pending = 0;
+
+/** Idle threads wait on an_idleCond until a task is pushed (an_pushed is changed) or the scan is finished */
+static pthread_mutex_t an_idleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t an_idleCond = PTHREAD_COND_INITIALIZER;
+static unsigned long an_pushed = 0;
+
 /** Filling the aTable table woks in recursive way, the table is implemented
-  * as dynamic array of max 10000 items (i.e. there can exist maximum 10000
-  * files and directories together on disk). More appropriate implementation would be
-  * using linked list, but for experiment purposes the dynamic array is enough.
+  * as dynamic array that is doubled whenever it is full, so the number of files and directories
+  * is not limited (only by memory).
   * This function adds new item into the aTable, however it fills only some informations in the item
   * @param startCluster starting cluster of the item
   * @param entCluster directory cluster that links to the item
@@ -69,17 +146,27 @@ unsigned short an_entryCount;
   */
 void an_addFile(unsigned long startCluster, unsigned long entCluster, unsigned short ind, unsigned char isDir)
 {
-  if (aTable == NULL) {
-    if ((aTable = (aTableItem *)malloc(MAX_FILES * sizeof(aTableItem))) == NULL)
+  if (tableCount == tableSize) {
+    tableSize = (tableSize) ? tableSize * 2 : AN_TABLE_INIT;
+    if ((aTable = (aTableItem *)realloc(aTable, tableSize * sizeof(aTableItem))) == NULL)
+      error(0, _("Out of memory !"));
+    if ((aStartCluster = (unsigned long *)realloc(aStartCluster, tableSize * sizeof(unsigned long))) == NULL)
+      error(0, _("Out of memory !"));
+    if ((aClusterCount = (unsigned long *)realloc(aClusterCount, tableSize * sizeof(unsigned long))) == NULL)
+      error(0, _("Out of memory !"));
+    if ((aParent = (unsigned long *)realloc(aParent, tableSize * sizeof(unsigned long))) == NULL)
       error(0, _("Out of memory !"));
-    tableCount = 0;
-  } else;
+  }
   tableCount++;
-  if (tableCount >= MAX_FILES) { free(aTable); error(0,_("Out of memory !"));}
-  aTable[tableCount-1].startCluster = startCluster;
+  aStartCluster[tableCount-1] = startCluster;
+  aClusterCount[tableCount-1] = 0;
+  aParent[tableCount-1] = 0;
   aTable[tableCount-1].entryCluster = entCluster;
   aTable[tableCount-1].entryIndex = ind;
   aTable[tableCount-1].isDir = isDir;
+  aTable[tableCount-1].extentIndex = 0;
+  aTable[tableCount-1].extentCount = 0;
+  aTable[tableCount-1].modified = 0;
 
   if (debug_mode)
     fprintf(output_stream, "(an_addFile) [%d]: start= 0x%5lx; dir= 0x%5lx; index= %2d; isDir=%d\n", tableCount-1, startCluster,entCluster,ind,isDir);
@@ -90,96 +177,371 @@ void an_addFile(unsigned long startCluster, unsigned long entCluster, unsigned s
 void an_freeTable()
 {
   free(aTable);
+  free(aStartCluster);
+  free(aClusterCount);
+  free(aParent);
+  free(anExtents);
+  aTable = NULL;
+  aStartCluster = aClusterCount = aParent = NULL;
+  tableCount = tableSize = 0;
+  anExtents = NULL;
+  anExtentCount = anExtentSize = 0;
+}
+
+/** The function adds a cluster to a pool of extents; if the cluster follows the last extent of the item, only the
+  * extent is extended. Otherwise a new extent is added into the pool (the pool is doubled if it is full).
+  * @param pool the pool of extents
+  * @param count number of extents in the pool
+  * @param size allocated size of the pool
+  * @param extend 1 if the last extent in the pool belongs to the item
+  * @param cluster the cluster
+  * @return 1 if a new extent was added, 0 otherwise
+  */
+static int an_poolAdd(anExtent **pool, unsigned long *count, unsigned long *size, int extend, unsigned long cluster)
+{
+  anExtent *last = (extend) ? &(*pool)[*count - 1] : NULL;
+
+  if (last && (last->start + last->length == cluster)) {
+    last->length++;
+    return 0;
+  }
+  if (*count == *size) {
+    *size = (*size) ? *size * 2 : 1024;
+    if ((*pool = (anExtent *)realloc(*pool, *size * sizeof(anExtent))) == NULL)
+      error(0, _("Out of memory !"));
+  }
+  (*pool)[*count].start = cluster;
+  (*pool)[*count].length = 1;
+  (*count)++;
+  return 1;
+}
+
+/** The function adds a cluster to the extents of the item.
+  * @param aTIndex index of the item in aTable (it has to be the last item that has extents)
+  * @param cluster the cluster
+  */
+void an_addCluster(unsigned long aTIndex, unsigned long cluster)
+{
+  if (an_poolAdd(&anExtents, &anExtentCount, &anExtentSize, aTable[aTIndex].extentCount != 0, cluster)) {
+    if (!aTable[aTIndex].extentCount)
+      aTable[aTIndex].extentIndex = anExtentCount - 1;
+    aTable[aTIndex].extentCount++;
+  }
 }
 
 /** The function determines percentage fragmentation of single directory item (file/directory). It is
   * part of the deep disk analysis.
   * 
-  * For given starting cluster it traverses all the chain of clusters and determines if clusters are
-  * going one after another, i.e. that if the difference of next and actual cluster number is 1. 
-  * In a case that not, it increments number of fragmented clusters.
+  * For given starting cluster it traverses all the chain of clusters and builds the list of extents (continuous
+  * runs of clusters) of the item. Each extent but the first one means a fragmented cluster, i.e. a cluster where the
+  * difference of its number and number of the previous cluster is not 1.
   * Within the traversion of the chain there is stored number of all clusters that were traversed. After
   * loop is finished, this variable contains number ofall clusters of the file or directory and it is stored.
-  * into aTable. Percentual fragmentation is computed as:
+  * into aTable. The traversion stops also on wrong values in FAT (free, bad or out of range clusters).
+  * Percentual fragmentation is computed as:
   * \code
   *   (num. of frag.cluster of the item) / (num. of all used clusters of the item) * 100
   * \endcode
   * @param startCluster Starting cluster of the item
-  * @param aTIndex index in aTable - into the table is written number of clusters of the directory item
+  * @param aTIndex index in aTable - into the table is written number of clusters and extents of the directory item
   * @return item fragmentation in percentage
 */
 float an_getFileFragmentation(unsigned long startCluster, unsigned long aTIndex)
 {
   unsigned long cluster; /* temp cluster */
-  int fragmentCount = 0; /* number of fragmented clusters */
-  int count = 0;	 /* number of file clusters; starting cluster is not considered */
+  int fragmentCount;     /* number of fragmented clusters */
+  unsigned long count = 0; /* number of file clusters */
   
-  for (cluster = startCluster, count=0; !F32_LAST(cluster); cluster = f32_getNextCluster(cluster),count++) {
-    if ((startCluster != cluster) && (startCluster+1 != cluster))
-      fragmentCount++;
-    startCluster = cluster;
+  aTable[aTIndex].extentCount = 0;
+  for (cluster = startCluster; (cluster >= 2) && (cluster <= info.clusterCount) && (count < info.clusterCount);
+       cluster = f32_getNextCluster(cluster)) {
+    an_addCluster(aTIndex, cluster);
+    count++;
   }
-  if (F32_LAST(cluster)) count++;
+  fragmentCount = (aTable[aTIndex].extentCount) ? aTable[aTIndex].extentCount - 1 : 0;
   usedClusters += count;
-  aTable[aTIndex].clusterCount = count;
+  aClusterCount[aTIndex] = count;
+  if (!count) return 0.0;
   return (float)(((float)fragmentCount / (float)count) * 100.0);
 }
 
-/** This function recursively traverses all directory structure. It is part of the first phase of disk analysis (the basic one).
-  * During the traversation it stores into aTable important information about directory item, such as starting cluster,
-  * number of directory cluster that contains link for given item and index in the directory cluster. Besides it calls
-  * for each item the an_getFileFragmentation function (to get its percentage fragmentation). This fragmentation is added to global
-  * variable called diskFragmentation. Be careful! The FAT table has to be OK; in the other case there can be circular referrences
-  * (or cross references)!
-  * @param startCluster number of root cluster (from where should the traversation start)
-*/
-void an_scanDisk(unsigned long startCluster)
+/** The function pushes a task into queue of the scanning thread.
+  * @param queue the queue
+  * @param task the task
+  */
+static void an_pushTask(an_TaskQueue *queue, an_ScanTask *task)
+{
+  __sync_fetch_and_add(&an_pending, 1);
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail == queue->size) {
+    if (queue->head) {
+      /* the stolen tasks leave a free space at the head */
+      memmove(queue->tasks, queue->tasks + queue->head, (queue->tail - queue->head) * sizeof(an_ScanTask *));
+      queue->tail -= queue->head;
+      queue->head = 0;
+    }
+    if (queue->tail == queue->size) {
+      queue->size = (queue->size) ? queue->size * 2 : 64;
+      if ((queue->tasks = (an_ScanTask **)realloc(queue->tasks, queue->size * sizeof(an_ScanTask *))) == NULL)
+        error(0, _("Out of memory !"));
+    }
+  }
+  queue->tasks[queue->tail++] = task;
+  pthread_mutex_unlock(&queue->lock);
+
+  pthread_mutex_lock(&an_idleLock);
+  an_pushed++;
+  pthread_cond_signal(&an_idleCond);
+  pthread_mutex_unlock(&an_idleLock);
+}
+
+/** The function takes a task from a queue.
+  * @param queue the queue
+  * @param steal 1 if the task is stolen by other thread (it is taken from the head), 0 if it is taken by the owner
+  * @return the task, or NULL if the queue is empty
+  */
+static an_ScanTask *an_takeTask(an_TaskQueue *queue, int steal)
+{
+  an_ScanTask *task = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail)
+    task = (steal) ? queue->tasks[queue->head++] : queue->tasks[--queue->tail];
+  if (queue->head == queue->tail)
+    queue->head = queue->tail = 0;
+  pthread_mutex_unlock(&queue->lock);
+  return task;
+}
+
+/** The function scans a single directory. It is the same traversion as the serial one was, but subdirectories are
+  * not scanned recursively; for each of them a new task is pushed into the queue of the thread. For each item
+  * the chain of its clusters is traversed (the FAT is only read, so it is shared by all the threads) and its extents
+  * are stored into the task. All clusters of the directory are read at once - continuous runs are put into the queue
+  * of disk requests of the thread, so they are in flight together. If the image is mapped, directory clusters are
+  * not copied.
+  * @param task the task with starting cluster of the directory
+  * @param queue queue of the thread
+  * @param io queue of disk requests of the thread
+  */
+static void an_scanDir(an_ScanTask *task, an_TaskQueue *queue, d_Queue *io)
 {
   unsigned short index;
-  unsigned long cluster, tmpCluster;
-  unsigned char tmpAttr;
-  F32_DirEntry *entries;
-  
-  /* In errorneous FATk we must count with clusterCount instead of 0xffffff0 */
-  if (startCluster > info.clusterCount) return;
+  unsigned long cluster, tmpCluster, count, i, j, chainCount = 0, chainSize = 0;
+  unsigned long *chain = NULL;
+  size_t size = an_entryCount * sizeof(F32_DirEntry);
+  unsigned char *data = NULL;
+  int mapped, end = 0;
+  an_ScanItem *item;
+  F32_DirEntry *dir;
 
-  if ((entries = (F32_DirEntry *)malloc(an_entryCount * sizeof(F32_DirEntry))) == NULL)
-    error(0, _("Out of memory !"));
+  for (cluster = task->startCluster; (cluster >= 2) && (cluster <= info.clusterCount) &&
+       (chainCount < info.clusterCount); cluster = f32_getNextCluster(cluster)) {
+    if (chainCount == chainSize) {
+      chainSize = (chainSize) ? chainSize * 2 : 16;
+      if ((chain = (unsigned long *)realloc(chain, chainSize * sizeof(unsigned long))) == NULL)
+        error(0, _("Out of memory !"));
+    }
+    chain[chainCount++] = cluster;
+  }
+  /* the mapped image is parsed directly */
+  mapped = (chainCount && f32_clusterAddress(chain[0])) ? 1 : 0;
+  if (chainCount && !mapped) {
+    data = (unsigned char *)d_allocBuffer(chainCount * size);
+    for (i = 0; i < chainCount; i = j) {
+      for (j = i + 1; (j < chainCount) && (chain[j] == chain[j-1] + 1); j++)
+        ;
+      f32_queueClusters(io, chain[i], j - i, data + i * size, 0);
+    }
+    if (d_waitQueue(io))
+      error(0, _("Can't read from image !"));
+  }
 
-  for (cluster = startCluster; !F32_LAST(cluster); cluster = f32_getNextCluster(cluster)) {
-    f32_readCluster(cluster, entries);
+  for (i = 0; (i < chainCount) && !end; i++) {
+    cluster = chain[i];
+    dir = (mapped) ? (F32_DirEntry *)f32_clusterAddress(cluster) : (F32_DirEntry *)(data + i * size);
     for (index = 0; index < an_entryCount; index++) {
-      if (!entries[index].fileName[0]) { free(entries); return; }
+      if (!dir[index].fileName[0]) { end = 1; break; }
       /* in the next we work with items that:
            1. are not deleted,
 	   2. are not slots (long names)
 	   3. do not point to parent or root directory
       */
-      if ((entries[index].fileName[0] != 0xe5) && 
-          entries[index].attributes != 0x0f &&
-          memcmp(entries[index].fileName,".       ",8) &&
-	  memcmp(entries[index].fileName,"..      ",8)) {
-	tmpAttr = entries[index].attributes & 0x10;
-        tmpCluster = f32_getStartCluster(entries[index]);
-	if (tmpCluster != 0) {
-          int isDir = 0;
-	  /* if the item is subdirectory, the function is called recursively */
-          if (tmpAttr == 0x10) {
-            isDir = 1;
-	    /* protection against infinite loop */
-	    if (tmpCluster != startCluster)
-	      an_scanDisk(tmpCluster);
-	  }
-          /* if a starting cluster is bad, it ignores the item */
-          if (tmpCluster <= info.clusterCount) {
-            an_addFile(tmpCluster,cluster,index,isDir);
-            diskFragmentation += an_getFileFragmentation(tmpCluster, tableCount-1);
-          }
-	}
+      if ((dir[index].fileName[0] == 0xe5) || dir[index].attributes == 0x0f ||
+          !memcmp(dir[index].fileName,".       ",8) || !memcmp(dir[index].fileName,"..      ",8))
+        continue;
+      tmpCluster = f32_getStartCluster(dir[index]);
+      /* if a starting cluster is bad, it ignores the item */
+      if ((tmpCluster == 0) || (tmpCluster > info.clusterCount))
+        continue;
+
+      if (task->itemCount == task->itemSize) {
+        task->itemSize = (task->itemSize) ? task->itemSize * 2 : 16;
+        if ((task->items = (an_ScanItem *)realloc(task->items, task->itemSize * sizeof(an_ScanItem))) == NULL)
+          error(0, _("Out of memory !"));
+      }
+      item = &task->items[task->itemCount++];
+      item->startCluster = tmpCluster;
+      item->entryCluster = cluster;
+      item->entryIndex = index;
+      item->isDir = ((dir[index].attributes & 0x10) == 0x10);
+      item->modified = ((unsigned long)dir[index].datestamp << 16) | dir[index].timestamp;
+      item->subdir = NULL;
+      /* if the item is subdirectory, it is scanned by a new task; protection against infinite loop */
+      if (item->isDir && (tmpCluster != task->startCluster)) {
+        if ((item->subdir = (an_ScanTask *)calloc(1, sizeof(an_ScanTask))) == NULL)
+          error(0, _("Out of memory !"));
+        item->subdir->startCluster = tmpCluster;
+        an_pushTask(queue, item->subdir);
       }
+
+      /* the same traversion of the chain as in an_getFileFragmentation */
+      item->extentIndex = task->extentCount;
+      item->extentCount = 0;
+      for (count = 0, tmpCluster = item->startCluster; (tmpCluster >= 2) && (tmpCluster <= info.clusterCount) &&
+           (count < info.clusterCount); tmpCluster = f32_getNextCluster(tmpCluster), count++)
+        item->extentCount += an_poolAdd(&task->extents, &task->extentCount, &task->extentSize,
+                                        item->extentCount != 0, tmpCluster);
+      item->clusterCount = count;
+      item->fragmentation = (count) ? (float)(((float)(item->extentCount - 1) / (float)count) * 100.0) : 0.0;
     }
   }
-  free(entries);
+  free(data);
+  free(chain);
+}
+
+/** Main loop of a scanning thread. The thread scans tasks from its own queue; if the queue is empty, it steals
+  * a task from queues of other threads, and if there is nothing to steal, it sleeps until a task is pushed. Each
+  * thread has its own queue of disk requests. The thread finishes when there are no pending tasks.
+  * @param arg index of the thread
+  */
+static void *an_scanThread(void *arg)
+{
+  unsigned long self = (unsigned long)arg, i, pushed;
+  an_ScanTask *task;
+  d_Queue *io = d_openQueue();
+
+  for (;;) {
+    /* a task pushed after this point wakes the thread up, even if the queues were already searched */
+    pthread_mutex_lock(&an_idleLock);
+    pushed = an_pushed;
+    pthread_mutex_unlock(&an_idleLock);
+
+    task = an_takeTask(&an_queues[self], 0);
+    for (i = 1; !task && (i < an_jobs); i++)
+      task = an_takeTask(&an_queues[(self + i) % an_jobs], 1);
+    if (task) {
+      an_scanDir(task, &an_queues[self], io);
+      if (__sync_sub_and_fetch(&an_pending, 1) == 0) {
+        pthread_mutex_lock(&an_idleLock);
+        pthread_cond_broadcast(&an_idleCond);
+        pthread_mutex_unlock(&an_idleLock);
+      }
+      continue;
+    }
+    pthread_mutex_lock(&an_idleLock);
+    while (an_pending && (pushed == an_pushed))
+      pthread_cond_wait(&an_idleCond, &an_idleLock);
+    pthread_mutex_unlock(&an_idleLock);
+    if (!an_pending)
+      break;
+  }
+  d_closeQueue(io);
+  return NULL;
+}
+
+/** The function frees the task (its subtasks have to be freed already) */
+static void an_freeTask(an_ScanTask *task)
+{
+  free(task->items);
+  free(task->extents);
+  free(task);
+}
+
+/** The function moves results of a task into aTable; subdirectories are merged recursively, so the order of items in
+  * aTable is the same as it was by the serial traversion (items of a subdirectory precede the subdirectory itself).
+  * The subtasks are freed.
+  * @param task the task
+  */
+static void an_mergeTask(an_ScanTask *task)
+{
+  unsigned long i, k;
+  an_ScanItem *item;
+
+  for (i = 0; i < task->itemCount; i++) {
+    item = &task->items[i];
+    if (item->subdir)
+      an_mergeTask(item->subdir);
+    an_addFile(item->startCluster, item->entryCluster, item->entryIndex, item->isDir);
+    item->index = tableCount - 1;
+    while (anExtentSize < anExtentCount + item->extentCount) {
+      anExtentSize = (anExtentSize) ? anExtentSize * 2 : 1024;
+      if ((anExtents = (anExtent *)realloc(anExtents, anExtentSize * sizeof(anExtent))) == NULL)
+        error(0, _("Out of memory !"));
+    }
+    memcpy(anExtents + anExtentCount, task->extents + item->extentIndex, item->extentCount * sizeof(anExtent));
+    aTable[tableCount-1].extentIndex = anExtentCount;
+    aTable[tableCount-1].extentCount = item->extentCount;
+    aTable[tableCount-1].modified = item->modified;
+    anExtentCount += item->extentCount;
+    aClusterCount[tableCount-1] = item->clusterCount;
+    usedClusters += item->clusterCount;
+    diskFragmentation += item->fragmentation;
+    if (item->subdir) {
+      /* the directory is added after its items, so they get their parent now */
+      for (k = 0; k < item->subdir->itemCount; k++)
+        aParent[item->subdir->items[k].index] = tableCount - 1;
+      an_freeTask(item->subdir);
+    }
+  }
+}
+
+/** This function traverses all directory structure. It is part of the first phase of disk analysis (the basic one).
+  * Directories are scanned in parallel by an_jobs threads: each directory is a task and subdirectories found in it
+  * are new tasks (idle threads steal them from the busy ones). The threads only read the FAT that is loaded in memory.
+  * After all the threads are finished, the results are merged into aTable: for each directory item there is stored
+  * its starting cluster, number of directory cluster that contains link for given item and index in the directory
+  * cluster, its extents and its fragmentation is added to global variable called diskFragmentation. Be careful! The
+  * FAT table has to be OK; in the other case there can be circular referrences (or cross references)!
+  * @param startCluster number of root cluster (from where should the traversation start)
+*/
+void an_scanDisk(unsigned long startCluster)
+{
+  pthread_t *threads;
+  an_ScanTask *root;
+  unsigned long i;
+
+  /* In errorneous FATk we must count with clusterCount instead of 0xffffff0 */
+  if (startCluster > info.clusterCount) return;
+
+  if (!an_jobs) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    an_jobs = (cpus > 0) ? cpus : 1;
+  }
+  if (((threads = (pthread_t *)malloc(an_jobs * sizeof(pthread_t))) == NULL) ||
+      ((an_queues = (an_TaskQueue *)calloc(an_jobs, sizeof(an_TaskQueue))) == NULL) ||
+      ((root = (an_ScanTask *)calloc(1, sizeof(an_ScanTask))) == NULL))
+    error(0, _("Out of memory !"));
+  for (i = 0; i < an_jobs; i++)
+    pthread_mutex_init(&an_queues[i].lock, NULL);
+  root->startCluster = startCluster;
+  an_pushTask(&an_queues[0], root);
+
+  for (i = 0; i < an_jobs; i++)
+    if (pthread_create(&threads[i], NULL, an_scanThread, (void *)i))
+      error(0, _("Can't create scanning thread !"));
+  for (i = 0; i < an_jobs; i++)
+    pthread_join(threads[i], NULL);
+
+  for (i = 0; i < an_jobs; i++) {
+    pthread_mutex_destroy(&an_queues[i].lock);
+    free(an_queues[i].tasks);
+  }
+  free(an_queues);
+  free(threads);
+  an_queues = NULL;
+
+  an_mergeTask(root);
+  an_freeTask(root);
 }
 
 /** Main function for disk analysis; before it calls an_scanDisk function, it performs
@@ -190,12 +552,17 @@ void an_scanDisk(unsigned long startCluster)
   */
 int an_analyze()
 {
+  unsigned long largestFree;
+
   fprintf(output_stream, _("Analysing disk...\n"));
 
   an_entryCount = (bpb.BPB_SecPerClus * info.BPSector) / sizeof(F32_DirEntry);
   /* first phase of analysis starts with root cluster */
   aTable = NULL;
-  tableCount = 0;
+  aStartCluster = aClusterCount = aParent = NULL;
+  tableCount = tableSize = 0;
+  anExtents = NULL;
+  anExtentCount = anExtentSize = 0;
   
   /* table contains also root cluster */
   an_addFile(bpb.BPB_RootClus, 0, 0, 1);
@@ -205,6 +572,11 @@ int an_analyze()
   diskFragmentation /= (tableCount - 1);
 
   fprintf(output_stream, _("Disk is fragmented for: %.2f%%\n"), diskFragmentation);
+  fprintf(output_stream, _("Files and directories: %lu, extents: %lu, used clusters: %lu\n"), tableCount,
+          anExtentCount, usedClusters);
+  sp_largest(&largestFree);
+  fprintf(output_stream, _("Free clusters: %lu, free extents: %lu, largest free extent: %lu\n"), spFreeClusters,
+          spExtentCount, largestFree);
  
   /*WARNING! We do not free memory in this time, but AFTER defragmentation,
     otherwise we would get an error "Segmentation fault" because the table will be
@@ -212,3 +584,69 @@ int an_analyze()
   */
   return 0;
 }
+
+/** Quick analysis of the disk: the function streams the in-memory FAT sequentially once, the directory structure is
+  * not traversed and no chain is followed. A discontinuity is an entry of used cluster that does not point to the next
+  * cluster and is not the end of a chain. Chain heads are found by a bitmap of clusters that have a predecessor: every
+  * used cluster without predecessor starts a chain. The bitmaps are compared word by word, so the second pass is only
+  * clusterCount / (bits in word) long.
+  * Fragmentation of the volume is computed as:
+  * \code
+  *   (num. of discontinuities) / (num. of used clusters) * 100
+  * \endcode
+  * and fragmentation of free space as (1 - (largest free extent) / (num. of free clusters)) * 100.
+  */
+int an_sweepFAT()
+{
+  unsigned long *used, *hasPred;	/* bitmaps indexed by cluster number */
+  unsigned long words, cluster, value, w;
+  unsigned long usedCount = 0, badCount = 0, breaks = 0, chains = 0;
+  unsigned long freeCount = 0, freeExtents = 0, freeRun = 0, largestFree = 0;
+
+  fprintf(output_stream, _("Sweeping FAT...\n"));
+
+  words = info.clusterCount / AN_WORD_BITS + 1;
+  if (((used = (unsigned long *)calloc(words, sizeof(unsigned long))) == NULL) ||
+      ((hasPred = (unsigned long *)calloc(words, sizeof(unsigned long))) == NULL))
+    error(0, _("Out of memory !"));
+
+  for (cluster = 2; cluster <= info.clusterCount; cluster++) {
+    value = FATtable[cluster] & 0x0fffffff;
+    if (F32_FREE(value)) {
+      freeCount++;
+      if (!freeRun++) freeExtents++;
+      if (freeRun > largestFree) largestFree = freeRun;
+      continue;
+    }
+    freeRun = 0;
+    if (F32_BAD(value)) {
+      badCount++;
+      continue;
+    }
+    usedCount++;
+    used[cluster / AN_WORD_BITS] |= 1UL << (cluster % AN_WORD_BITS);
+    /* the end of a chain (or a wrong value) has no follower */
+    if ((value < 2) || (value > info.clusterCount))
+      continue;
+    hasPred[value / AN_WORD_BITS] |= 1UL << (value % AN_WORD_BITS);
+    if (value != cluster + 1)
+      breaks++;
+  }
+  for (w = 0; w < words; w++)
+    chains += __builtin_popcountl(used[w] & ~hasPred[w]);
+  free(used);
+  free(hasPred);
+
+  fprintf(output_stream, _("Disk is fragmented for: %.2f%%\n"),
+          (usedCount) ? (float)breaks / (float)usedCount * 100.0 : 0.0);
+  fprintf(output_stream, _("Chains: %lu, discontinuities: %lu, used clusters: %lu, bad clusters: %lu\n"), chains,
+          breaks, usedCount, badCount);
+  if (chains)
+    fprintf(output_stream, _("Average chain: %.2f clusters, %.2f extents\n"), (float)usedCount / (float)chains,
+            (float)(chains + breaks) / (float)chains);
+  fprintf(output_stream, _("Free space is fragmented for: %.2f%%\n"),
+          (freeCount) ? (1.0 - (float)largestFree / (float)freeCount) * 100.0 : 0.0);
+  fprintf(output_stream, _("Free clusters: %lu, free extents: %lu, largest free extent: %lu\n"), freeCount,
+          freeExtents, largestFree);
+  return 0;
+}
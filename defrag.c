@@ -25,99 +25,791 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <libintl.h>
 #include <locale.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include <entry.h>
 #include <analyze.h>
 #include <fat32.h>
 #include <disk.h>
+#include <plan.h>
+#include <intent.h>
 
 
 /** temporary buffer for directory items (if direntry is updated) */
 F32_DirEntry *entries = NULL;
-F32_DirEntry *entries2 = NULL; // temp
 unsigned short entryCount;
 
-/** 1. cache of cluster */
-unsigned char *cacheCluster1 = NULL;
-/** 2. cache of cluster */
-unsigned char *cacheCluster2 = NULL;
+/** maximal number of clusters that can be carried by the "school bus" at once */
+#define DEF_BUS_SIZE 256
+/** number of buses - one is filled, one is read and one is written at the same time */
+#define DEF_BUS_RING 3
 
-/** index of cluster that is actually defragmenting (it is used for percentage computation)*/
+/** states of a bus */
+#define DEF_BUS_FREE  0  /* the bus is empty, or it is filled now */
+#define DEF_BUS_READ  1  /* the bus waits for the reader */
+#define DEF_BUS_WRITE 2  /* the data were read, the bus waits for the writer */
+
+/** Seat in the "school bus" - data of one cluster carried from its original position */
+typedef struct {
+  unsigned long origin;  /* cluster from where the data come */
+  unsigned char loaded;  /* if the data are already in the buffer */
+  unsigned char dirty;   /* if the data were changed in the buffer */
+  unsigned char empty;   /* if the cluster was free (its data don't need to be carried) */
+  unsigned char *data;   /* buffer of the cluster size */
+} def_BusSeat;
+
+/** The "school bus" - the seats and the list of clusters that are read and written during its ride */
+typedef struct {
+  def_BusSeat seats[DEF_BUS_SIZE];     /* seats of the bus */
+  unsigned long count;                 /* number of occupied seats */
+  unsigned long stops[DEF_BUS_SIZE];   /* clusters touched by the bus (bus stops), in order of touching */
+  unsigned long reads[DEF_BUS_SIZE];   /* seats with data that have to be read, sorted by origin */
+  unsigned long readCount;
+  unsigned long writes[DEF_BUS_SIZE];  /* clusters that get new data, sorted */
+  void *writeData[DEF_BUS_SIZE];       /* the new data of the clusters */
+  unsigned long writeCount;
+  int state;                           /* DEF_BUS_FREE, DEF_BUS_READ or DEF_BUS_WRITE */
+} def_Bus;
+
+/** ring of the buses, they are driven in order */
+def_Bus *buses = NULL;
+/** the bus that is filled now */
+def_Bus *bus = NULL;
+/** busSeatOf[x] holds (index + 1) of the seat of the filled bus with data that belong to cluster x now, 0 if
+    cluster x is not touched */
+unsigned long *busSeatOf = NULL;
+/** buffer for cluster data of all seats of all buses */
+unsigned char *busData = NULL;
+/** lock of the bus states */
+pthread_mutex_t busLock;
+/** signalled when a state of some bus is changed */
+pthread_cond_t busCond;
+/** if the reader and the writer should end */
+int busQuit = 0;
+/** the reader and the writer thread */
+pthread_t busReader, busWriter;
+
+/** maximal number of directory clusters kept in the directory cache */
+#define DEF_DIR_CACHE_SIZE 512
+
+/** Slot of the directory cache - data of one directory cluster */
+typedef struct {
+  unsigned long cluster; /* cluster where the data belong now */
+  unsigned char dirty;   /* if the data were changed and not written yet */
+  unsigned char *data;   /* buffer of the cluster size */
+} def_DirSlot;
+
+/** slots of the directory cache */
+def_DirSlot *dirSlots = NULL;
+/** number of used slots */
+unsigned long dirCount = 0;
+/** dirSlotOf[x] holds (index + 1) of the slot with data of directory cluster x, 0 if the cluster is not cached */
+unsigned long *dirSlotOf = NULL;
+/** buffer for cluster data of all slots */
+unsigned char *dirData = NULL;
+
+/** number of clusters that were already moved (it is used for percentage computation)*/
 unsigned long clusterIndex;
 
+/** maximal duration of the program run in seconds, counted from def_startTime (0 means no limit) */
+unsigned long def_maxTime = 0;
+/** maximal number of bytes transferred from/to the image (0 means no limit) */
+unsigned long long def_maxIO = 0;
+/** time when the program was started */
+time_t def_startTime = 0;
+/** name of the file where the progress is saved if the defragmentation is stopped (NULL if it is not saved) */
+const char *def_resumeFile = NULL;
+/** it is set when SIGINT or SIGTERM comes - the defragmentation should be stopped */
+volatile sig_atomic_t def_stopSignal = 0;
+
+/** Index of starting clusters: startIndex[x] holds (index + 1) of the aTable item starting at cluster x,
+    or 0 if no item starts there. Cluster numbers are dense, so the cluster itself is used as the hash key. */
+unsigned long *startIndex = NULL;
+/** Index of directory entries: entryHead[x] holds (index + 1) of the first aTable item whose entry is located
+    in directory cluster x (0 if there is no such item) */
+unsigned long *entryHead = NULL;
+/** entryNext[i] holds (index + 1) of the next aTable item with the same entryCluster as item i (0 = end of list) */
+unsigned long *entryNext = NULL;
+/** childHead[i] holds (index + 1) of the first subdirectory of directory item i (0 if there is none) */
+unsigned long *childHead = NULL;
+/** childNext[i] holds (index + 1) of the next subdirectory of the same directory as item i (0 = end of list) */
+unsigned long *childNext = NULL;
+
+/** Change of a starting cluster in a directory entry */
+typedef struct {
+  unsigned long cluster;  /* directory cluster with the entry */
+  unsigned long value;    /* new starting cluster */
+  const char *name;       /* expected name of the entry (for "." and ".." entries), or NULL */
+  unsigned short index;   /* index of the entry in the cluster */
+} def_Fix;
+
+/** list of changes of directory entries waiting to be applied */
+def_Fix *fixes = NULL;
+/** number of changes in the list and its allocated size */
+unsigned long fixCount = 0, fixSize = 0;
+/** items moved since the last fix of metadata */
+unsigned long *movedItems = NULL;
+/** number of moved items */
+unsigned long movedCount = 0;
+/** movedMark[i] is 1 if item i is in movedItems */
+unsigned char *movedMark = NULL;
+
+/** The function builds indexes of aTable keyed by starting cluster and by entry cluster, and lists of subdirectories
+ *  of directories. The table is traversed backwards, so if more items start at the same cluster (cross referrences),
+ *  the first one is found.
+ */
+void def_buildIndex()
+{
+  unsigned long i;
+
+  if ((startIndex = (unsigned long *)calloc(info.clusterCount + 1, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((entryHead = (unsigned long *)calloc(info.clusterCount + 1, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((entryNext = (unsigned long *)calloc(tableCount, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((childHead = (unsigned long *)calloc(tableCount, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((childNext = (unsigned long *)calloc(tableCount, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((movedItems = (unsigned long *)malloc(tableCount * sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((movedMark = (unsigned char *)calloc(tableCount, sizeof(unsigned char))) == NULL)
+    error(0,_("Out of memory !"));
+  movedCount = fixCount = 0;
+
+  for (i = tableCount; i > 0; i--) {
+    if (aStartCluster[i-1] <= info.clusterCount)
+      startIndex[aStartCluster[i-1]] = i;
+    /* root directory has no entry */
+    if (aTable[i-1].entryCluster && (aTable[i-1].entryCluster <= info.clusterCount)) {
+      entryNext[i-1] = entryHead[aTable[i-1].entryCluster];
+      entryHead[aTable[i-1].entryCluster] = i;
+      /* list of subdirectories of each directory */
+      if (aTable[i-1].isDir && (aParent[i-1] != i-1)) {
+        childNext[i-1] = childHead[aParent[i-1]];
+        childHead[aParent[i-1]] = i;
+      }
+    }
+  }
+}
+
+/** The function frees memory used by aTable indexes */
+void def_freeIndex()
+{
+  free(fixes);
+  free(movedMark);
+  free(movedItems);
+  free(childNext);
+  free(childHead);
+  fixes = NULL;
+  fixSize = 0;
+  movedMark = NULL;
+  movedItems = childNext = childHead = NULL;
+  free(entryNext);
+  free(entryHead);
+  free(startIndex);
+  entryNext = entryHead = startIndex = NULL;
+}
+
 /** The function finds parent of cluster from FAT
- *  If parameter has value 0, parent is not searched. In the other case whole FAT is being scanned
- *  if some cluster links to the cluster given as parameter.
+ *  If parameter has value 0, parent is not searched. In the other case the reverse-link table kept
+ *  together with the in-memory FAT is used (the FAT doesn't need to be scanned).
  * @param cluster number of cluster that we need parent of
  * @return number of parent cluster of the given cluster or 0 in a case that it is not found or it is
  *         root cluster.
  */
 unsigned long def_findParent(unsigned long cluster)
 {
-  unsigned long i, val;
   if (!cluster) return 0;
-  for (i = 2; i <= info.clusterCount; i++) {
-    if (f32_readFAT(i, &val)) error(0,_("Can't read from FAT !"));
-    if (val == cluster) return i;
+  return f32_getParent(cluster);
+}
+
+/** The function waits until the bus gets into given state (busLock has to be locked) */
+void def_busWaitFor(def_Bus *b, int state)
+{
+  while ((b->state != state) && !busQuit)
+    pthread_cond_wait(&busCond, &busLock);
+}
+
+/** The function changes state of the bus and wakes up the other threads */
+void def_busSetState(def_Bus *b, int state)
+{
+  pthread_mutex_lock(&busLock);
+  b->state = state;
+  pthread_cond_broadcast(&busCond);
+  pthread_mutex_unlock(&busLock);
+}
+
+/** The function waits until all the buses on the ride return, so the disk can be accessed directly. */
+void def_busWait()
+{
+  unsigned long i;
+
+  pthread_mutex_lock(&busLock);
+  for (i = 0; i < DEF_BUS_RING; i++)
+    def_busWaitFor(&buses[i], DEF_BUS_FREE);
+  pthread_mutex_unlock(&busLock);
+}
+
+/** comparator of cluster numbers (used by qsort and bsearch) */
+int def_cmpCluster(const void *a, const void *b)
+{
+  unsigned long c1 = *(const unsigned long *)a;
+  unsigned long c2 = *(const unsigned long *)b;
+  return (c1 > c2) - (c1 < c2);
+}
+
+/** The function determines if the bus has to read some cluster that is not written yet by an older bus (busLock
+ *  has to be locked).
+ *  @param b the bus
+ *  @return 1 if the bus has to wait, 0 otherwise
+ */
+int def_busConflict(def_Bus *b)
+{
+  unsigned long i, j;
+  def_Bus *o;
+
+  for (i = 0; i < DEF_BUS_RING; i++) {
+    o = &buses[i];
+    if ((o == b) || (o->state != DEF_BUS_WRITE)) continue;
+    for (j = 0; j < b->readCount; j++)
+      if (bsearch(&b->seats[b->reads[j]].origin, o->writes, o->writeCount, sizeof(unsigned long), def_cmpCluster))
+        return 1;
   }
   return 0;
 }
 
-/**
- * Function determines if a cluster is starting cluster (the aTable is translated)
- * @param cluster testing cluster
- * @param index it is output variable that will contain incremented index in aTable, if the
- *              cluster was starting. If not, its value will be 0.
- * @return it returns 1, if cluster is starting or 0 otherwise
-*/
-int def_isStarting(unsigned long cluster, unsigned long *index)
+/** The reader thread - collecting children. It reads data of the buses in order of their rides (continuous runs at
+ *  once, all the runs in flight together if the requests are asynchronous). Data of clusters that are still
+ *  going to be written by an older bus are read after the write.
+ */
+void *def_busReader(void *arg)
 {
-  unsigned long i;
-  for (i = 0; i < tableCount; i++)
-    if (aTable[i].startCluster == cluster) {
-      *index = (i+1);
-      return 1;
+  unsigned long next, i, j, size = bpb.BPB_SecPerClus * info.BPSector;
+  void *bufs[DEF_BUS_SIZE];
+  struct iovec iov[DEF_BUS_SIZE];
+  d_Queue *io = d_openQueue();
+  def_BusSeat *seat;
+  def_Bus *b;
+
+  (void)arg;
+  d_registerBuffer(io, busData, DEF_BUS_RING * DEF_BUS_SIZE * size);
+  for (next = 0; ; next = (next + 1) % DEF_BUS_RING) {
+    b = &buses[next];
+    pthread_mutex_lock(&busLock);
+    def_busWaitFor(b, DEF_BUS_READ);
+    while ((b->state == DEF_BUS_READ) && def_busConflict(b))
+      pthread_cond_wait(&busCond, &busLock);
+    pthread_mutex_unlock(&busLock);
+    if (b->state != DEF_BUS_READ) break;
+
+    for (i = 0; i < b->readCount; i = j) {
+      for (j = i; (j < b->readCount) && (b->seats[b->reads[j]].origin == b->seats[b->reads[i]].origin + (j - i)); j++) {
+        seat = &b->seats[b->reads[j]];
+        bufs[j] = seat->data;
+        seat->loaded = 1;
+      }
+      /* the runs of the bus don't overlap in bufs and iov, so they can be in flight together */
+      if (d_queueAsync(io) && (j - i == 1))
+        f32_queueClusters(io, b->seats[b->reads[i]].origin, 1, bufs[i], 0);
+      else if (d_queueAsync(io))
+        f32_queueClustersv(io, b->seats[b->reads[i]].origin, j - i, &bufs[i], &iov[i], 0);
+      else if (f32_readClustersv(b->seats[b->reads[i]].origin, j - i, &bufs[i]))
+        error(0,_("Can't read from image (cluster:0x%lx)!"), b->seats[b->reads[i]].origin);
+    }
+    if (d_waitQueue(io))
+      error(0,_("Can't read from image !"));
+    def_busSetState(b, DEF_BUS_WRITE);
+  }
+  d_closeQueue(io);
+  return NULL;
+}
+
+/** The writer thread - dumping children near the school. It writes data of the buses to their new positions in order
+ *  of their rides (continuous runs at once, all the runs in flight together if the requests are asynchronous).
+ *  After the write the bus is free.
+ */
+void *def_busWriter(void *arg)
+{
+  unsigned long next, i, j, k, size = bpb.BPB_SecPerClus * info.BPSector;
+  struct iovec iov[DEF_BUS_SIZE];
+  d_Queue *io = d_openQueue();
+  def_Bus *b;
+
+  (void)arg;
+  d_registerBuffer(io, busData, DEF_BUS_RING * DEF_BUS_SIZE * size);
+  for (next = 0; ; next = (next + 1) % DEF_BUS_RING) {
+    b = &buses[next];
+    pthread_mutex_lock(&busLock);
+    def_busWaitFor(b, DEF_BUS_WRITE);
+    pthread_mutex_unlock(&busLock);
+    if (b->state != DEF_BUS_WRITE) break;
+
+    /* original data of the clusters are saved into the intent log (the read data are used where it is possible) */
+    for (i = 0, k = 0; i < b->writeCount; i++) {
+      while ((k < b->readCount) && (b->seats[b->reads[k]].origin < b->writes[i]))
+        k++;
+      in_protectCluster(b->writes[i], ((k < b->readCount) && (b->seats[b->reads[k]].origin == b->writes[i]))
+                        ? b->seats[b->reads[k]].data : NULL);
     }
-  *index = 0;
+    if (in_sync())
+      error(0,_("Can't write intent log !"));
+
+    for (i = 0; i < b->writeCount; i = j) {
+      for (j = i; (j < b->writeCount) && (b->writes[j] == b->writes[i] + (j - i)); j++)
+        ;
+      if (d_queueAsync(io) && (j - i == 1))
+        f32_queueClusters(io, b->writes[i], 1, b->writeData[i], 1);
+      else if (d_queueAsync(io))
+        f32_queueClustersv(io, b->writes[i], j - i, &b->writeData[i], &iov[i], 1);
+      else if (f32_writeClustersv(b->writes[i], j - i, &b->writeData[i]))
+        error(0,_("Can't write to image (cluster:0x%lx) !"), b->writes[i]);
+    }
+    if (d_waitQueue(io))
+      error(0,_("Can't write to image !"));
+    def_busSetState(b, DEF_BUS_FREE);
+  }
+  d_closeQueue(io);
+  return NULL;
+}
+
+/** The function allocates the "school bus" - the engine for batched relocation of clusters.
+ *
+ *  Clusters are not physically switched immediately. The switches are only recorded by the bus (which data belongs
+ *  to which cluster) and the bus is "driven" (def_busDrive) when it is full or at the end of the defragmentation.
+ *  During the ride all the data are read at once from their scattered positions (continuous runs by single disk
+ *  operation), and then written to their final positions, again continuous runs by single disk operation. So a run
+ *  of clusters of a file is written by one large sequential write to the target extent, and clusters that were
+ *  in the way are evicted together. Each cluster is written at most once per ride, even if it was switched more times.
+ *  If the disk requests can be asynchronous (io_uring), the clusters are read and written by single requests that
+ *  are all in flight together, directly from/to the registered buffer of the buses.
+ *
+ *  The rides are pipelined: there is a ring of buses, and while the main thread fills one of them, the reader thread
+ *  reads the data of the previous bus and the writer thread writes the bus before it. If all the buses are on the
+ *  ride, the main thread waits until the oldest one returns.
+ */
+void def_busInit()
+{
+  unsigned long i, j, size = bpb.BPB_SecPerClus * info.BPSector;
+  sigset_t signals, old;
+
+  if ((buses = (def_Bus *)malloc(DEF_BUS_RING * sizeof(def_Bus))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((busSeatOf = (unsigned long *)calloc(info.clusterCount + 1, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  busData = (unsigned char *)d_allocBuffer(DEF_BUS_RING * DEF_BUS_SIZE * size);
+  for (i = 0; i < DEF_BUS_RING; i++) {
+    for (j = 0; j < DEF_BUS_SIZE; j++)
+      buses[i].seats[j].data = busData + (i * DEF_BUS_SIZE + j) * size;
+    buses[i].count = 0;
+    buses[i].state = DEF_BUS_FREE;
+  }
+  bus = &buses[0];
+  busQuit = 0;
+  pthread_mutex_init(&busLock, NULL);
+  pthread_cond_init(&busCond, NULL);
+  /* the signals are handled by the main thread only */
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &old);
+  if (pthread_create(&busReader, NULL, def_busReader, NULL) || pthread_create(&busWriter, NULL, def_busWriter, NULL))
+    error(0,_("Can't create relocation thread !"));
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/** The function stops the reader and the writer and frees memory of the buses (they have to be empty) */
+void def_busFree()
+{
+  pthread_mutex_lock(&busLock);
+  busQuit = 1;
+  pthread_cond_broadcast(&busCond);
+  pthread_mutex_unlock(&busLock);
+  pthread_join(busReader, NULL);
+  pthread_join(busWriter, NULL);
+  pthread_cond_destroy(&busCond);
+  pthread_mutex_destroy(&busLock);
+  free(busData);
+  free(busSeatOf);
+  free(buses);
+  busData = NULL;
+  busSeatOf = NULL;
+  buses = bus = NULL;
+}
+
+/** The function puts the data of the cluster into the bus, if they are not there yet. The data are not read now,
+ *  but lazily (during ride or when somebody needs them). It has to be called before the cluster is changed in FAT,
+ *  because data of free clusters are not carried.
+ *  @param cluster number of the cluster
+ */
+void def_busBoard(unsigned long cluster)
+{
+  unsigned long value;
+  def_BusSeat *seat = &bus->seats[bus->count];
+
+  if (busSeatOf[cluster]) return;
+  if (f32_readFAT(cluster, &value)) error(0,_("Can't read from FAT !"));
+  seat->origin = cluster;
+  seat->loaded = 0;
+  seat->dirty = 0;
+  seat->empty = F32_FREE(value) ? 1 : 0;
+  bus->stops[bus->count] = cluster;
+  busSeatOf[cluster] = ++bus->count;
+}
+
+/** The function returns the seat with data of the cluster; data are read if they were not read yet.
+ *  @param cluster number of cluster that is in the bus
+ *  @return the seat
+ */
+def_BusSeat *def_busLoad(unsigned long cluster)
+{
+  def_BusSeat *seat = &bus->seats[busSeatOf[cluster] - 1];
+
+  if (!seat->loaded && !seat->empty) {
+    def_busWait();
+    if (f32_readCluster(seat->origin, seat->data))
+      error(0,_("Can't read from image (cluster:0x%lx)!"), seat->origin);
+  }
+  seat->loaded = 1;
+  return seat;
+}
+
+/** The function reads a cluster that can be moved by the bus (i.e. its data can be still on other position).
+ *  @param cluster number of cluster
+ *  @param buffer[output] the buffer of the cluster size
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int def_busRead(unsigned long cluster, void *buffer)
+{
+  if (!busSeatOf[cluster]) {
+    def_busWait();
+    return f32_readCluster(cluster, buffer);
+  }
+  memcpy(buffer, def_busLoad(cluster)->data, bpb.BPB_SecPerClus * info.BPSector);
   return 0;
 }
 
-/** The function find first usable cluster (output is directed into outCluster variable) and its value (the output is
-  * directed into outValue).
-  * Usable cluster is that can be overwritten (is in the "interval of good clusters") and is not bad.
-  * @param beginCluster from where we should start to search
-  * @param outCluster output variable - found usable cluster
-  * @param outValue output variable - value of found cluster
-  * @return it returns 1 in case of an error, or 0 otherwise.
-  */
-int def_findFirstUsable(unsigned long beginCluster, unsigned long *outCluster, unsigned long *outValue)
+/** The function writes a cluster that can be moved by the bus. If the cluster is in the bus, the data are only
+ *  changed in the bus and written during the ride.
+ *  @param cluster number of cluster
+ *  @param buffer the buffer of the cluster size
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int def_busWrite(unsigned long cluster, void *buffer)
 {
-  unsigned long cluster;
-  unsigned long value = 0;
-  char found = 0;
- 
-  if (debug_mode) 
-    fprintf(output_stream,_("(def_findFirstUsable) First usable cluster from 0x%lx is: "), beginCluster);
-
-  for (cluster = beginCluster; cluster <= info.clusterCount; cluster++) {
-    if (f32_readFAT(cluster, &value)) error(0,_("Can't read from FAT !"));
-    if (value != F32_BAD_L) {
-      found = 1;
-      break;
+  def_BusSeat *seat;
+
+  if (!busSeatOf[cluster]) {
+    def_busWait();
+    return f32_writeCluster(cluster, buffer);
+  }
+  seat = &bus->seats[busSeatOf[cluster] - 1];
+  memcpy(seat->data, buffer, bpb.BPB_SecPerClus * info.BPSector);
+  seat->loaded = seat->dirty = 1;
+  seat->empty = 0;
+  return 0;
+}
+
+/** The function switches data of two clusters in the bus (both of them have to be boarded already).
+ *  @param cluster1 number of the first cluster
+ *  @param cluster2 number of the second cluster
+ */
+void def_busSwitch(unsigned long cluster1, unsigned long cluster2)
+{
+  unsigned long tmp = busSeatOf[cluster1];
+  busSeatOf[cluster1] = busSeatOf[cluster2];
+  busSeatOf[cluster2] = tmp;
+}
+
+/** comparator of seat indexes of the filled bus by origin of the data (used by qsort) */
+int def_cmpSeatOrigin(const void *a, const void *b)
+{
+  unsigned long o1 = bus->seats[*(const unsigned long *)a].origin;
+  unsigned long o2 = bus->seats[*(const unsigned long *)b].origin;
+  return (o1 > o2) - (o1 < o2);
+}
+
+/** The bus departs. The function prepares the lists of the ride - data that were not read yet are read, and
+ *  clusters that get new data are written (only if the data were moved or changed; data of free clusters are never
+ *  written). Then the bus is passed to the reader and the next bus is taken (the function waits if it is still on
+ *  the ride).
+ */
+void def_busDrive()
+{
+  unsigned long i;
+  def_BusSeat *seat;
+
+  if (!bus->count) return;
+  for (i = 0, bus->readCount = 0; i < bus->count; i++)
+    if (!bus->seats[i].loaded && !bus->seats[i].empty)
+      bus->reads[bus->readCount++] = i;
+  qsort(bus->reads, bus->readCount, sizeof(unsigned long), def_cmpSeatOrigin);
+  for (i = 0, bus->writeCount = 0; i < bus->count; i++) {
+    seat = &bus->seats[busSeatOf[bus->stops[i]] - 1];
+    if (!seat->empty && (seat->dirty || (seat->origin != bus->stops[i])))
+      bus->writes[bus->writeCount++] = bus->stops[i];
+  }
+  qsort(bus->writes, bus->writeCount, sizeof(unsigned long), def_cmpCluster);
+  for (i = 0; i < bus->writeCount; i++)
+    bus->writeData[i] = bus->seats[busSeatOf[bus->writes[i]] - 1].data;
+
+  if (debug_mode)
+    fprintf(output_stream, "  (def_busDrive) %lu clusters touched, %lu written\n", bus->count, bus->writeCount);
+
+  for (i = 0; i < bus->count; i++)
+    busSeatOf[bus->stops[i]] = 0;
+  def_busSetState(bus, DEF_BUS_READ);
+
+  bus = &buses[(bus - buses + 1) % DEF_BUS_RING];
+  pthread_mutex_lock(&busLock);
+  def_busWaitFor(bus, DEF_BUS_FREE);
+  pthread_mutex_unlock(&busLock);
+  bus->count = 0;
+}
+
+/** The function finishes all the rides - after it all moved data are at their new positions. */
+void def_busFlush()
+{
+  def_busDrive();
+  def_busWait();
+}
+
+/** The function allocates the directory cache. Directory clusters that are changed during the defragmentation
+ *  (start clusters in entries, "." and ".." entries) are kept in memory and written back only when the cache is full,
+ *  at checkpoints or at the end of the defragmentation. The cache is keyed by cluster number and follows relocations
+ *  of the clusters (def_dirSwitch), so a directory cluster is written once, even if it is changed many times or moved.
+ *  The cache is placed over the bus - it reads and writes the clusters by def_busRead and def_busWrite.
+ */
+void def_dirInit()
+{
+  unsigned long i, size = bpb.BPB_SecPerClus * info.BPSector;
+
+  if ((dirSlots = (def_DirSlot *)malloc(DEF_DIR_CACHE_SIZE * sizeof(def_DirSlot))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((dirSlotOf = (unsigned long *)calloc(info.clusterCount + 1, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  dirData = (unsigned char *)d_allocBuffer(DEF_DIR_CACHE_SIZE * size);
+  for (i = 0; i < DEF_DIR_CACHE_SIZE; i++)
+    dirSlots[i].data = dirData + i * size;
+  dirCount = 0;
+}
+
+/** The function frees memory of the directory cache (it has to be flushed) */
+void def_dirFree()
+{
+  free(dirData);
+  free(dirSlotOf);
+  free(dirSlots);
+  dirData = NULL;
+  dirSlotOf = NULL;
+  dirSlots = NULL;
+}
+
+/** The function writes all dirty directory clusters back (into the bus, or onto the disk).
+ *  @param evict if the cache should be emptied
+ */
+void def_dirFlush(int evict)
+{
+  unsigned long i, n = 0;
+
+  for (i = 0; i < dirCount; i++) {
+    if (dirSlots[i].dirty) {
+      if (def_busWrite(dirSlots[i].cluster, dirSlots[i].data))
+        error(0,_("Can't write to image (cluster:0x%lx) !"), dirSlots[i].cluster);
+      dirSlots[i].dirty = 0;
+      n++;
+    }
+    if (evict)
+      dirSlotOf[dirSlots[i].cluster] = 0;
+  }
+  if (evict)
+    dirCount = 0;
+  if (debug_mode && n)
+    fprintf(output_stream, "  (def_dirFlush) %lu directory clusters written\n", n);
+}
+
+/** The function returns the slot with data of the directory cluster; if the cluster is not cached, it is read
+ *  (the cache is emptied if it is full).
+ *  @param cluster number of the directory cluster
+ *  @return the slot
+ */
+def_DirSlot *def_dirLoad(unsigned long cluster)
+{
+  def_DirSlot *slot;
+
+  if (dirSlotOf[cluster])
+    return &dirSlots[dirSlotOf[cluster] - 1];
+  if (dirCount == DEF_DIR_CACHE_SIZE)
+    def_dirFlush(1);
+  slot = &dirSlots[dirCount];
+  if (def_busRead(cluster, slot->data))
+    error(0,_("Can't read from image (cluster:0x%lx)!"), cluster);
+  slot->cluster = cluster;
+  slot->dirty = 0;
+  dirSlotOf[cluster] = ++dirCount;
+  return slot;
+}
+
+/** The function reads a directory cluster through the directory cache.
+ *  @param cluster number of the directory cluster
+ *  @param buffer[output] the buffer of the cluster size
+ */
+void def_dirRead(unsigned long cluster, void *buffer)
+{
+  memcpy(buffer, def_dirLoad(cluster)->data, bpb.BPB_SecPerClus * info.BPSector);
+}
+
+/** The function writes a directory cluster into the directory cache; it is written back later.
+ *  @param cluster number of the directory cluster
+ *  @param buffer the buffer of the cluster size
+ */
+void def_dirWrite(unsigned long cluster, void *buffer)
+{
+  def_DirSlot *slot = def_dirLoad(cluster);
+
+  memcpy(slot->data, buffer, bpb.BPB_SecPerClus * info.BPSector);
+  slot->dirty = 1;
+}
+
+/** The function switches cached data of two clusters, if some of them are cached (their data were switched).
+ *  @param cluster1 number of the first cluster
+ *  @param cluster2 number of the second cluster
+ */
+void def_dirSwitch(unsigned long cluster1, unsigned long cluster2)
+{
+  unsigned long tmp = dirSlotOf[cluster1];
+
+  dirSlotOf[cluster1] = dirSlotOf[cluster2];
+  dirSlotOf[cluster2] = tmp;
+  if (dirSlotOf[cluster1])
+    dirSlots[dirSlotOf[cluster1] - 1].cluster = cluster1;
+  if (dirSlotOf[cluster2])
+    dirSlots[dirSlotOf[cluster2] - 1].cluster = cluster2;
+}
+
+/** The function records that the starting cluster of the aTable item was changed; its metadata will be fixed by
+ *  def_fixMetadata.
+ *  @param index index of the item in aTable
+ */
+void def_markMoved(unsigned long index)
+{
+  if (movedMark[index]) return;
+  movedMark[index] = 1;
+  movedItems[movedCount++] = index;
+}
+
+/** The function adds a change of a directory entry into the list of fixes.
+ *  @param cluster directory cluster with the entry
+ *  @param index index of the entry in the cluster
+ *  @param name expected name of the entry ("." or ".." entries), or NULL
+ *  @param value new starting cluster of the entry
+ */
+void def_addFix(unsigned long cluster, unsigned short index, const char *name, unsigned long value)
+{
+  if (fixCount == fixSize) {
+    fixSize = (fixSize) ? fixSize * 2 : 1024;
+    if ((fixes = (def_Fix *)realloc(fixes, fixSize * sizeof(def_Fix))) == NULL)
+      error(0,_("Out of memory !"));
+  }
+  fixes[fixCount].cluster = cluster;
+  fixes[fixCount].index = index;
+  fixes[fixCount].name = name;
+  fixes[fixCount].value = value;
+  fixCount++;
+}
+
+/** comparator of fixes by directory cluster and entry index (used by qsort) */
+int def_cmpFix(const void *a, const void *b)
+{
+  const def_Fix *f1 = (const def_Fix *)a, *f2 = (const def_Fix *)b;
+
+  if (f1->cluster != f2->cluster)
+    return (f1->cluster > f2->cluster) - (f1->cluster < f2->cluster);
+  return (f1->index > f2->index) - (f1->index < f2->index);
+}
+
+/** The function fixes metadata of all items moved since the last call. The changes are computed from aTable
+ *  (the items have their current starting and entry clusters, aParent gives directory of each item):
+ *
+ *  - starting cluster in the directory entry of the item (BPB_RootClus for root directory),
+ *  - "." and ".." entries of a moved directory,
+ *  - ".." entries of subdirectories of a moved directory (0 if the directory is root).
+ *
+ *  The changes are sorted by directory cluster and applied in one pass; each directory cluster is read and
+ *  written once (through the directory cache).
+ */
+void def_fixMetadata()
+{
+  unsigned long i, j, k, item, child, clusters = 0;
+  int rootMoved = 0;
+
+  for (i = 0; i < movedCount; i++) {
+    item = movedItems[i];
+    movedMark[item] = 0;
+    if (!aTable[item].entryCluster) {
+      rootMoved = 1;
+      bpb.BPB_RootClus = aStartCluster[item];
+    } else
+      def_addFix(aTable[item].entryCluster, aTable[item].entryIndex, NULL, aStartCluster[item]);
+    if (!aTable[item].isDir) continue;
+    if (aTable[item].entryCluster) {
+      def_addFix(aStartCluster[item], 0, ".       ", aStartCluster[item]);
+      def_addFix(aStartCluster[item], 1, "..      ",
+                 (aTable[aParent[item]].entryCluster) ? aStartCluster[aParent[item]] : 0);
     }
+    for (child = childHead[item]; child; child = childNext[child-1])
+      def_addFix(aStartCluster[child-1], 1, "..      ", (aTable[item].entryCluster) ? aStartCluster[item] : 0);
   }
-  if (!found) {
+  movedCount = 0;
+
+  if (rootMoved) {
     if (debug_mode)
-      fprintf(output_stream,_("Not found!\n"));
-    return 1;
+      fprintf(output_stream, "  (def_fixMetadata) root=0x%lx\n", bpb.BPB_RootClus);
+    in_protect(0, 1, NULL);
+    if (in_sync() || (d_writeSectors(0, (char*)&bpb, 1, 512) != 1))
+      error(0,_("Can't write to image (pos.:0x%lx)!"), 0L);
   }
-  if (debug_mode)
-    fprintf(output_stream,_("0x%lx\n"), cluster);
-  *outCluster = cluster;
-  *outValue = value;
-  return 0;
+
+  qsort(fixes, fixCount, sizeof(def_Fix), def_cmpFix);
+  for (i = 0; i < fixCount; i = j) {
+    def_dirRead(fixes[i].cluster, entries);
+    for (j = i; (j < fixCount) && (fixes[j].cluster == fixes[i].cluster); j++) {
+      if (fixes[j].name && memcmp(entries[fixes[j].index].fileName, fixes[j].name, 8))
+        continue;
+      if (debug_mode) {
+        fprintf(output_stream, "  (def_fixMetadata) 0x%lx.%d '", fixes[j].cluster, fixes[j].index);
+        for (k = 0; k < 8; k++)
+          fprintf(output_stream, "%c", entries[fixes[j].index].fileName[k]);
+        fprintf(output_stream, "'.start=0x%lx (new 0x%lx)\n", f32_getStartCluster(entries[fixes[j].index]),
+                fixes[j].value);
+      }
+      f32_setStartCluster(fixes[j].value, &entries[fixes[j].index]);
+    }
+    def_dirWrite(fixes[i].cluster, entries);
+    clusters++;
+  }
+  if (debug_mode && fixCount)
+    fprintf(output_stream, "  (def_fixMetadata) %lu entries in %lu directory clusters\n", fixCount, clusters);
+  fixCount = 0;
+}
+
+/**
+ * Function determines if a cluster is starting cluster (the index of starting clusters is used)
+ * @param cluster testing cluster
+ * @param index it is output variable that will contain incremented index in aTable, if the
+ *              cluster was starting. If not, its value will be 0.
+ * @return it returns 1, if cluster is starting or 0 otherwise
+*/
+int def_isStarting(unsigned long cluster, unsigned long *index)
+{
+  *index = (cluster <= info.clusterCount) ? startIndex[cluster] : 0;
+  return (*index) ? 1 : 0;
 }
 
 /**
@@ -125,15 +817,8 @@ int def_findFirstUsable(unsigned long beginCluster, unsigned long *outCluster, u
  *
  * Clusters can be starting, or part in a file chain. They can be directories, slots or file data.
  *
- * If a cluster is starting:
- *
- * -# Update dir entry -> set the other cluster to be starting in the directory entry.
- * -# If it is root, update also bpb (FAT32 can have root cluster anywhere).
- *
- * If a cluster is directory:
- *
- * -# Point the "." direntry of that cluster to the other cluster
- * -# Point the ".." direntry of that cluster to the parent of this cluster
+ * If a cluster is starting, the item is only marked as moved (def_markMoved); its directory entry, "." and ".."
+ * entries and BPB_RootClus are updated later, together with other moved items (def_fixMetadata).
  *
  * If a cluster is part of a chain
  *
@@ -144,7 +829,8 @@ int def_findFirstUsable(unsigned long beginCluster, unsigned long *outCluster, u
  * -# Switching the cluster values in FAT table.
  * -# Updating values in aTable (all files having entryCluster set to the one cluster
  *    must point to the other cluster)
- * -# Switching real data in clusters
+ * -# Switching real data in clusters (the switch is recorded by the "school bus" and performed later, together
+ *    with other switches)
  *
  * There must be taken care for infinite loop, as it is shown in the following example:
  *
@@ -185,7 +871,6 @@ void def_switchClusters(unsigned long cluster1, unsigned long cluster2)
 					  */
   unsigned long tmpVal1, tmpVal2;
   unsigned long clus1val, clus2val;
-  int i; // temp variable
 
   if (debug_mode)
     fprintf(output_stream,_("  (def_switchClusters) 0x%lx <=> 0x%lx\n"), cluster1, cluster2);
@@ -193,63 +878,22 @@ void def_switchClusters(unsigned long cluster1, unsigned long cluster2)
   if (cluster1 == cluster2)
     return;
 
-  /* 1. find out if clusters are starting. If yes, update dir entry. */
-  /* be careful on root! It can be one of the clusters */
+  /* both clusters get on the bus before they are changed in FAT */
+  if (bus->count + 2 > DEF_BUS_SIZE)
+    def_busDrive();
+  def_busBoard(cluster1);
+  def_busBoard(cluster2);
+
+  /* 1. find out if clusters are starting. */
     def_isStarting(cluster1, &isStarting1);
     def_isStarting(cluster2, &isStarting2);
 
     if (debug_mode) {
       // what we know about the clusters.
-      tmpVal1 = def_findParent(cluster1);
-      fprintf(output_stream, _("    1:parent= 0x%lx\n"), tmpVal1);
-      tmpVal1 = def_findParent(cluster2);
-      fprintf(output_stream, _("    2:parent= 0x%lx\n"), tmpVal1);
-      tmpVal1 = 0;
+      fprintf(output_stream, _("    1:parent= 0x%lx%s\n"), def_findParent(cluster1), (isStarting1) ? " (starting)" : "");
+      fprintf(output_stream, _("    2:parent= 0x%lx%s\n"), def_findParent(cluster2), (isStarting2) ? " (starting)" : "");
     }
     
-    if (isStarting1) {
-      if (!aTable[isStarting1-1].entryCluster) {
-        /* the first cluster is root */
-        if (debug_mode)
-          fprintf(output_stream, "    1:0x%lx=(root)\n", cluster1);
-	bpb.BPB_RootClus = cluster2;
-	d_writeSectors(0, (char*)&bpb, 1, bpb.BPB_SecPerClus);
-      } else {
-        f32_readCluster(aTable[isStarting1-1].entryCluster, entries);
-        if (debug_mode) {
-          // what we know about the clusters.
-          fprintf(output_stream, "    1:'");
-          for (i = 0; i < 8; i++)
-            fprintf(output_stream,   "%c", entries[aTable[isStarting1-1].entryIndex].fileName[i]);
-          fprintf(output_stream, _("' 0x%lx=(files[%lx]); dir=0x%lx.entry=%d; start=0x%lx (new 0x%lx)\n"),
-            cluster1, isStarting1-1, aTable[isStarting1-1].entryCluster, aTable[isStarting1-1].entryIndex,
-            f32_getStartCluster(entries[aTable[isStarting1-1].entryIndex]), cluster2);
-	}
-        f32_setStartCluster(cluster2,&entries[aTable[isStarting1-1].entryIndex]);
-        f32_writeCluster(aTable[isStarting1-1].entryCluster, entries);
-      }
-    }
-    if (isStarting2) {
-      if (!aTable[isStarting2-1].entryCluster) {
-        if (debug_mode)
-          fprintf(output_stream, "  2:0x%lx=(root)\n", cluster2);
-        /* second cluster is root */
-	bpb.BPB_RootClus = cluster1;
-	d_writeSectors(0, (char*)&bpb, 1, bpb.BPB_SecPerClus);
-      } else {
-        f32_readCluster(aTable[isStarting2-1].entryCluster, entries);
-	if (debug_mode) {
-          fprintf(output_stream, "    2:'");
-          for (i = 0; i < 8; i++)
-            fprintf(output_stream, "%c", entries[aTable[isStarting2-1].entryIndex].fileName[i]);
-          fprintf(output_stream, _("' 0x%lx=(files[%lx]); dir=0x%lx.entry=%d; start=0x%lx (new 0x%lx)\n"),
-            cluster2, isStarting2-1, aTable[isStarting2-1].entryCluster, aTable[isStarting2-1].entryIndex,
-            f32_getStartCluster(entries[aTable[isStarting2-1].entryIndex]), cluster1);
-	}
-        f32_setStartCluster(cluster1,&entries[aTable[isStarting2-1].entryIndex]);
-        f32_writeCluster(aTable[isStarting2-1].entryCluster, entries);
-      }
-    }
   /* 2. update FAT */
     if (f32_readFAT(cluster1, &clus1val)) error(0,_("Can't read from FAT !"));
     if (f32_readFAT(cluster2, &clus2val)) error(0,_("Can't read from FAT !"));
@@ -293,181 +937,130 @@ void def_switchClusters(unsigned long cluster1, unsigned long cluster2)
       f32_writeFAT(cluster2, clus1val);
     }
 
-    /* update aTable */
-    if (isStarting1)
-      aTable[isStarting1-1].startCluster = cluster2;
-    if (isStarting2)
-      aTable[isStarting2-1].startCluster = cluster1;
+    /* update aTable and index of starting clusters; the metadata of moved items are fixed later */
+    if (isStarting1) {
+      aStartCluster[isStarting1-1] = cluster2;
+      def_markMoved(isStarting1-1);
+    }
+    if (isStarting2) {
+      aStartCluster[isStarting2-1] = cluster1;
+      def_markMoved(isStarting2-1);
+    }
+    startIndex[cluster1] = isStarting2;
+    startIndex[cluster2] = isStarting1;
 
     /* If some of switched clusters was direntry of some starting cluster in aTable, we have to update
-       also this value */
-    for (tmpVal1 = 0; tmpVal1 < tableCount; tmpVal1++) {
-      if (aTable[tmpVal1].entryCluster == cluster1) {
-        tmpVal2 = aTable[tmpVal1].entryCluster;
-        aTable[tmpVal1].entryCluster = cluster2;
-        if (debug_mode)
-          fprintf(output_stream, "    file[%lu].entryCluster (originally 0x%lx) = 0x%lx\n", tmpVal1, tmpVal2,cluster2);
-      }
-      else if (aTable[tmpVal1].entryCluster == cluster2) {
-        tmpVal2 = aTable[tmpVal1].entryCluster;
-        aTable[tmpVal1].entryCluster = cluster1;
-        if (debug_mode)
-          fprintf(output_stream, "    file[%lu].entryCluster (originally 0x%lx) = 0x%lx\n", tmpVal1, tmpVal2, cluster1);
-      }
+       also this value; the lists of items of both clusters are switched */
+    tmpVal1 = entryHead[cluster1];
+    entryHead[cluster1] = entryHead[cluster2];
+    entryHead[cluster2] = tmpVal1;
+    for (tmpVal1 = entryHead[cluster2]; tmpVal1; tmpVal1 = entryNext[tmpVal1-1]) {
+      aTable[tmpVal1-1].entryCluster = cluster2;
+      if (debug_mode)
+        fprintf(output_stream, "    file[%lu].entryCluster (originally 0x%lx) = 0x%lx\n", tmpVal1-1, cluster1, cluster2);
+    }
+    for (tmpVal1 = entryHead[cluster1]; tmpVal1; tmpVal1 = entryNext[tmpVal1-1]) {
+      aTable[tmpVal1-1].entryCluster = cluster1;
+      if (debug_mode)
+        fprintf(output_stream, "    file[%lu].entryCluster (originally 0x%lx) = 0x%lx\n", tmpVal1-1, cluster2, cluster1);
     }
 
-  /* 3. physicall switch */
-    f32_readCluster(cluster1, cacheCluster1);
-    f32_readCluster(cluster2, cacheCluster2);
-    f32_writeCluster(cluster1, cacheCluster2);
-    f32_writeCluster(cluster2, cacheCluster1);
+  /* 3. physicall switch (it is done by the bus later), cached directory data go with it */
+    def_busSwitch(cluster1, cluster2);
+    def_dirSwitch(cluster1, cluster2);
 
     if (debug_mode) {
-      i = def_findParent(cluster1);
-      fprintf(output_stream, _("    1:(new)0x%lx.parent= 0x%lx, value=0x%lx\n"), cluster1, i, f32_getNextCluster(cluster1));
-      i = def_findParent(cluster2);
-      fprintf(output_stream, _("    2:(new)0x%lx.parent= 0x%lx, value=0x%lx\n"), cluster2, i, f32_getNextCluster(cluster2));
+      fprintf(output_stream, _("    1:(new)0x%lx.parent= 0x%lx, value=0x%lx\n"), cluster1, def_findParent(cluster1),
+              f32_getNextCluster(cluster1));
+      fprintf(output_stream, _("    2:(new)0x%lx.parent= 0x%lx, value=0x%lx\n"), cluster2, def_findParent(cluster2),
+              f32_getNextCluster(cluster2));
     }
+}
 
-    /* Update "." and ".." entries if one of starting cluster was directory*/
 
-    // if a directory is moving somewhere else, 
-    // in all its dir entries we must find subdirectories,
-    // load their entries and at every '..' entry put the new value
-    // of the directory cluster..
-    if ((entries2 = (F32_DirEntry *)malloc(entryCount * sizeof(F32_DirEntry))) == NULL) {
-      error(0, _("Out of memory !"));
-    }
+/** The handler of SIGINT and SIGTERM; the defragmentation is stopped at the nearest consistent place. The second
+ *  signal terminates the program immediately (the default action is restored).
+ */
+void def_signal(int sig)
+{
+  (void)sig;
+  def_stopSignal = 1;
+}
 
-    if (isStarting1 && aTable[isStarting1-1].isDir) {
-      // cluster1 will point to cluster2
-      for (tmpVal1 = cluster2; !F32_LAST(tmpVal1); tmpVal1 = f32_getNextCluster(tmpVal1)) {
-        f32_readCluster(tmpVal1, entries);
-        if (!memcmp(entries[0].fileName,".       ",8)) {
-          // found it
-          if (debug_mode) {
-            fprintf(output_stream, "    1:0x%lx.%d ('.').start=0x%lx (new 0x%lx)\n", tmpVal1,0,
-            f32_getStartCluster(entries[0]), cluster2);
-          }
-          f32_setStartCluster(cluster2,&entries[0]);
-        }
-        if (!memcmp(entries[1].fileName,"..      ",8)) {
-          tmpVal2 = def_findParent(tmpVal1);
-          // found it
-          if (debug_mode) {
-            fprintf(output_stream, "    1:0x%lx.%d ('..').start=0x%lx (new 0x%lx)\n", tmpVal1,1,
-            f32_getStartCluster(entries[1]), tmpVal2);
-          }
-          f32_setStartCluster(tmpVal2,&entries[1]);
-        }
-        f32_writeCluster(tmpVal1, entries);
-
-        for (i = 0; i < entryCount; i++) {
-          if (!memcmp(entries[i].fileName,".       ",8)) continue;
-          if (!memcmp(entries[i].fileName,".       ",8)) continue;
-          if (entries[i].fileName[0] == 0) continue;
-          if (entries[i].fileName[0] == 0xe5) continue;
-          if ((entries[i].attributes & 0x10) == 0x10) {
-            // subdirectory
-            tmpVal2 = f32_getStartCluster(entries[i]);
-            f32_readCluster(tmpVal2, entries2);
-            if (!memcmp(entries2[1].fileName,"..      ",8)) {
-              if (debug_mode) {
-                fprintf(output_stream, "    1:0x%lx->0x%lx.%d ('..').start=0x%lx (new 0x%lx): '", tmpVal1, tmpVal2,1,
-                  f32_getStartCluster(entries2[1]), cluster2);
-                int k;
-                for (k = 0; k < 8; k++) fprintf(output_stream,"%c",entries[i].fileName[k]);
-                fprintf(output_stream, "'\n");
-              }
-              f32_setStartCluster(cluster2, &entries2[1]);
-              f32_writeCluster(tmpVal2, entries2);
-            }
-          }
-        }
-      }
-    }
-    if (isStarting2 && aTable[isStarting2-1].isDir) {
-      for (tmpVal1 = cluster1; !F32_LAST(tmpVal1); tmpVal1 = f32_getNextCluster(tmpVal1)) {
-        // cluster2 will point to cluster1
-        f32_readCluster(tmpVal1, entries);
-        if (!memcmp(entries[0].fileName,".       ",8)) {
-          // found it
-          if (debug_mode) {
-            fprintf(output_stream, "    2:0x%lx.%d ('.').start=0x%lx (new 0x%lx)\n", tmpVal1,0,
-            f32_getStartCluster(entries[0]), cluster1);
-          }
-          f32_setStartCluster(cluster1,&entries[0]);
-        }
-        if (!memcmp(entries[1].fileName,"..      ",8)) {
-          tmpVal2 = def_findParent(tmpVal1);
-          // found it
-          if (debug_mode) {
-            fprintf(output_stream, "    2:0x%lx.%d ('..').start=0x%lx (new 0x%lx)\n", tmpVal1,1,
-            f32_getStartCluster(entries[1]), tmpVal2);
-          }
-          f32_setStartCluster(tmpVal2,&entries[1]);
-        }
-        f32_writeCluster(tmpVal1, entries);
-        for (i = 0; i < entryCount; i++) {
-          if (!memcmp(entries[i].fileName,".       ",8)) continue;
-          if (!memcmp(entries[i].fileName,".       ",8)) continue;
-          if (entries[i].fileName[0] == 0) continue;
-          if (entries[i].fileName[0] == 0xe5) continue;
-          if ((entries[i].attributes & 0x10) == 0x10) {
-            // subdirectory
-            tmpVal2 = f32_getStartCluster(entries[i]);
-            f32_readCluster(tmpVal2, entries2);
-            if (!memcmp(entries2[1].fileName,"..      ",8)) {
-              if (debug_mode) {
-                fprintf(output_stream, "    2: 0x%lx->0x%lx.%d ('..').start=0x%lx (new 0x%lx): '", tmpVal1,tmpVal2,1,
-                  f32_getStartCluster(entries2[1]), cluster1);
-                int k;
-                for (k = 0; k < 8; k++) fprintf(output_stream,"%c",entries[i].fileName[k]);
-                fprintf(output_stream, "'\n");
-              }
-              f32_setStartCluster(cluster1, &entries2[1]);
-              f32_writeCluster(tmpVal2, entries2);
-            }
-          }
-        }
-      }
-    }
-    free(entries2);
+/** The function determines if the defragmentation should be stopped (by a signal, or a budget was exhausted).
+ *  @return reason of the stop, or NULL if the defragmentation can go on
+ */
+const char *def_stopReason()
+{
+  if (def_stopSignal)
+    return _("interrupted");
+  if (def_maxTime && (time(NULL) - def_startTime >= (time_t)def_maxTime))
+    return _("time limit reached");
+  if (def_maxIO && (d_transferred >= def_maxIO))
+    return _("I/O limit reached");
+  return NULL;
 }
 
+/** The function returns serial number of the volume (BS_VolID) */
+unsigned long def_volumeID()
+{
+  return bpb.BS_VolID[0] | (bpb.BS_VolID[1] << 8) | (bpb.BS_VolID[2] << 16) | ((unsigned long)bpb.BS_VolID[3] << 24);
+}
 
-/** This function finds a new location (optimal) for starting cluster in case of need.
-  * It works by classic algorithm, i.e. it founds closest usable cluster from beginCluster
-  * and if it is less than original startCluster, they will switch.
-  * @param startCluster current starting cluster
-  * @param beginCluster from where we can search for new starting cluster
-  * @param outputCluster output variable - there a new number of starting cluster will be written
-  * @return function returns 0 if there was no error, or 1 otherwise.
-  */
-int def_optimizeStartCluster(unsigned long startCluster, unsigned long beginCluster, unsigned long *outputCluster)
+/** The function computes a fingerprint of the file system layout (the FAT and the root cluster). The progress saved
+ *  in the resume file is used only if the layout was not changed since the defragmentation was stopped.
+ */
+unsigned long def_fingerprint()
+{
+  unsigned long hash = 2166136261UL, cluster;
+
+  for (cluster = 0; cluster <= info.clusterCount; cluster++)
+    hash = (hash ^ (FATtable[cluster] & 0x0fffffff)) * 16777619UL;
+  return (hash ^ bpb.BPB_RootClus) * 16777619UL;
+}
+
+/** The function loads the progress of the stopped defragmentation from def_resumeFile. The chains are not skipped:
+ *  the plan is computed again for the current layout and the chains finished before have no moves in it. Only the
+ *  number of moved clusters goes on, if the image was not changed since the stop.
+ *  @param moved[output] number of clusters moved by the previous runs
+ *  @return 1 if the progress belongs to the image, 0 otherwise
+ */
+int def_loadProgress(unsigned long *moved)
 {
-  unsigned long newCluster, value;
+  FILE *fin;
+  unsigned long volID, fingerprint, m;
+  int ok;
 
-  if (startCluster == beginCluster)
+  if ((fin = fopen(def_resumeFile, "r")) == NULL)
     return 0;
+  ok = (fscanf(fin, "F32ID-RESUME %lx %lx %lu", &volID, &fingerprint, &m) == 3);
+  fclose(fin);
+  if (!ok || (volID != def_volumeID()) || (fingerprint != def_fingerprint()))
+    return 0;
+  *moved = m;
+  return 1;
+}
 
-  if (def_findFirstUsable(beginCluster, &newCluster, &value))
-    return 1;
-  if (startCluster > newCluster) {
-    if (debug_mode)
-      fprintf(output_stream, _("(def_optimizeStartCluster) moving 0x%lx to 0x%lx\n"), startCluster, newCluster);
-    def_switchClusters(startCluster, newCluster);
-    if (newCluster > beginCluster)
-      *outputCluster = newCluster;
-  } 
-  return 0;
+/** The function saves the progress of the stopped defragmentation into def_resumeFile (the image has to be
+ *  consistent already).
+ *  @param moved number of clusters moved so far
+ */
+void def_saveProgress(unsigned long moved)
+{
+  FILE *fout;
+
+  if ((fout = fopen(def_resumeFile, "w")) == NULL)
+    error(0,_("Can't write resume file: %s"), def_resumeFile);
+  fprintf(fout, "F32ID-RESUME %lx %lx %lu\n", def_volumeID(), def_fingerprint(), moved);
+  if (fclose(fout))
+    error(0,_("Can't write resume file: %s"), def_resumeFile);
 }
 
 /**
  * This function draws graphical progress bar from '=' chars.
  * Percentage is computed based on equations:
  * \code
- *   percent = (number of defragmented cluster) / (number of all used clusters) * 100
+ *   percent = (number of moved clusters) / (number of clusters to move by the plan) * 100
  *   (number of '=') = size / 100 * percent
  * \endcode
  * @param size size of the progress bar
@@ -478,7 +1071,8 @@ void print_bar(int size)
   double percent;
   int count, i;
  
-  percent = ((double)clusterIndex / (double)usedClusters) * 100.0;
+  if (!planMoves) return;
+  percent = ((double)clusterIndex / (double)planMoves) * 100.0;
 
   if ((int)percent == old_percent)
     return;
@@ -497,95 +1091,115 @@ void print_bar(int size)
   fflush(stdout);
 }
 
-/** The function defragments non-starting clusters of file/directory, it works only with a single cluster
- *  WARNING! FAT had to be OK, it does not have to contain cross referrences.
- *
- *  @param startCluster number of starting cluster
- *  @return function returns number of last cluster that was defragmented
- */
-unsigned long def_defragFile(unsigned long startCluster)
-{
-  unsigned long cluster1, cluster2, tmpClus, tmp;
-  
-  cluster1 = startCluster;
-  cluster2 = startCluster;
-  for (;;) {
-    cluster2 = f32_getNextCluster(cluster1);
-    clusterIndex++;
-    /* end of the file */
-    if (F32_LAST(cluster2)) { cluster2 = cluster1; break; }
-    /* free, reserved cluster */
-    if (F32_FREE(cluster2) || F32_RESERVED(cluster2)) { cluster2 = cluster1; break; }
-    /* bad cluster */
-    if (F32_BAD(cluster2)) { cluster2 = cluster1; break; }
-    /* bad value in FAT */
-    if ((cluster2 > 0xfffffff) || (cluster2 > info.clusterCount)) { cluster2 = cluster1; break; }
-
-    if ((cluster1+1) != cluster2) {
-      if (def_findFirstUsable(cluster1+1, &tmpClus, &tmp)) break;
-      if (debug_mode)
-        fprintf(output_stream,_("  (def_defragFile) defragmenting chain: %lx->%lx to %lx->%lx\n"), cluster1, cluster2, cluster1, tmpClus);
-      if (cluster2 > tmpClus) {
-        /* it is needed to defragment */
-        def_switchClusters(cluster2, tmpClus);
-	cluster2 = tmpClus;
-      }
-    }
-    cluster1 = cluster2;
-    if (!debug_mode)
-      print_bar(30);
-  }
-  return cluster2;
-}
-
 /** The function defragments files/directories according to aTable.
- *  It allocates memory for clusters cache, then for direntry buffer. Defragmentation runs in a cycle.
- *  In that cycle, at first new (optimal) starting cluster is found for actual item in aTable. Then a function
- *  for non-starting clusters defragmentation is called.
+ *  It allocates the "school bus", then direntry buffer. At first, the plan of the defragmentation is computed (the
+ *  final position of every cluster). Then the chains of moves of the plan are applied one by one, each of them from
+ *  its end - so every cluster is moved just once (the bus writes it only at its final position), only in a cycle
+ *  the data of one cluster has to travel around the cycle in the bus.
+ *
+ *  Every move (a switch of two clusters) leaves the FAT consistent; directory entries of the moved items are fixed
+ *  later by def_fixMetadata. So the defragmentation can be stopped after any move - by a signal or when a budget
+ *  (def_maxTime, def_maxIO) is exhausted - and the metadata are fixed and all the changes are written as at the end.
+ *  The number of moved clusters is saved into def_resumeFile; the next run plans the rest for the new layout.
+ *  Without the intent log and the FAT cache limit, a checkpoint is taken after every chain, so a crash can damage
+ *  only the chain that is being moved.
  *  @return Function returns 0, if there was no error.
  */
 int def_defragTable()
 {
   unsigned long tableIndex;
-  unsigned long defClus = 1;
-  unsigned long i, j = 0, k = 0;
+  unsigned long from = 2, end, cluster, source, moved = 0;
+  const char *stop = NULL;
+  struct sigaction action;
+  int cycle;
 
   fprintf(output_stream, _("Defragmenting disk...\n"));
+  /* the I/O budget is counted from here, the analysis is not included */
+  d_transferred = 0;
 
   /* Allocation of direntry and temporary clusters */
   entryCount = (bpb.BPB_SecPerClus * info.BPSector) / sizeof(F32_DirEntry);
   if ((entries = (F32_DirEntry *)malloc(entryCount * sizeof(F32_DirEntry))) == NULL) error(0,_("Out of memory !"));
-  if ((cacheCluster1 = (unsigned char*)malloc(bpb.BPB_SecPerClus * info.BPSector * sizeof(unsigned char))) == NULL) error(0, _("Out of memory !"));
-  if ((cacheCluster2 = (unsigned char*)malloc(bpb.BPB_SecPerClus * info.BPSector * sizeof(unsigned char))) == NULL) error(0, _("Out of memory !"));
+  def_busInit();
+  def_dirInit();
+  def_buildIndex();
+  in_start();
 
   if (debug_mode) {
     fprintf(output_stream, _("(def_defragTable) original aTable values (%lu): "), tableCount);
     for (tableIndex = 0; tableIndex < tableCount; tableIndex++)
-      fprintf(output_stream, "%lx | ", aTable[tableIndex].startCluster);
+      fprintf(output_stream, "%lx | ", aStartCluster[tableIndex]);
+    fprintf(output_stream, "\n");
   }
 
+  pl_plan();
+  pl_print(output_stream);
+
+  if (def_resumeFile && def_loadProgress(&moved))
+    fprintf(output_stream, _("The defragmentation was stopped before (%lu clusters were moved), the rest was planned "
+                             "again.\n"), moved);
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = def_signal;
+  action.sa_flags = SA_RESETHAND;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
   clusterIndex = 0;
-  for (tableIndex = 0; tableIndex < tableCount; tableIndex++) {
-    /* Optimally places starting cluster, it can cause additional fragmentation */
-    defClus++;
-    def_optimizeStartCluster(aTable[tableIndex].startCluster, defClus, &defClus);
-    clusterIndex++;
-    /* Defragmentation of non-starting clusters */
-    defClus = def_defragFile(aTable[tableIndex].startCluster);
-
-    if (!debug_mode)
-      print_bar(30);
+  while ((end = pl_nextChain(&from, &cycle))) {
+    if (debug_mode)
+      fprintf(output_stream, "(def_defragTable) %s ending at 0x%lx\n", (cycle) ? "cycle" : "path", end);
+    for (cluster = end; (source = planSource[cluster]) && (source != end); cluster = source) {
+      def_switchClusters(source, cluster);
+      clusterIndex++;
+      if (!debug_mode)
+        print_bar(30);
+      if ((stop = def_stopReason()))
+        break;
+    }
+    if (stop) break;
+    if (cycle) clusterIndex++;
+
+    /* the chain is consistent now, dirty FAT sectors can be written (but data have to be moved before) */
+    if (f32_checkpointDue()) {
+      def_fixMetadata();
+      def_dirFlush(0);
+      def_busFlush();
+      if (f32_checkpoint())
+        error(0,_("Can't write FAT !"));
+    }
   }
+  if (!debug_mode)
+    print_bar(30);
   fprintf(output_stream,"\n");
+  def_fixMetadata();
+  def_dirFlush(1);
+  def_busFlush();
+  if (f32_flushFAT() || d_datasync() || in_commit())
+    error(0,_("Can't write FAT !"));
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  if (stop) {
+    fprintf(output_stream, _("Defragmentation stopped (%s), %lu of %lu clusters moved.\n"), stop, clusterIndex,
+            planMoves);
+    if (def_resumeFile) {
+      def_saveProgress(moved + clusterIndex);
+      fprintf(output_stream, _("The progress was saved into %s.\n"), def_resumeFile);
+    }
+  } else if (def_resumeFile)
+    unlink(def_resumeFile);
 
   if (debug_mode) {
     fprintf(output_stream, _("(def_defragTable) aTable values (%lu): "), tableCount);
     for (tableIndex = 0; tableIndex < tableCount; tableIndex++)
-      fprintf(output_stream, "%lx | ", aTable[tableIndex].startCluster);
+      fprintf(output_stream, "%lx | ", aStartCluster[tableIndex]);
   }
 
-  free(cacheCluster2);
-  free(cacheCluster1);
+  pl_free();
+  def_freeIndex();
+  def_dirFree();
+  def_busFree();
   free(entries);
 
   return 0;
@@ -5,9 +5,22 @@
  *
  * The aim was to write independent module for controlling physical disk operations that is possible to rewrite in
  * future also for real disk usage without modification needs of other modules. There are implemented some basic
- * functions, such as disk mount (assigning a file descriptor), loading/storing some sectors. These functions are
- * implemented in a way that every disk change is only movement of a pointer into the image file, given by file
- * descriptor called disk_descriptor and on given location they perform the operations.
+ * functions, such as disk mount (assigning a file descriptor), loading/storing some sectors. These functions use
+ * positional I/O (pread/pwrite and their vectored variants preadv/pwritev) on the image file given by file descriptor
+ * called disk_descriptor, so a single system call is needed for each request and the file pointer is never moved.
+ *
+ * Optionally (d_useMmap) the image is mapped into memory. The sector functions keep the same contract, they only copy
+ * data from/to the mapping, and other modules can get address of mapped sectors (d_address) and read them directly.
+ * Changed part of the mapping is written by msync at checkpoints (d_sync) and when the disk is un-mounted.
+ *
+ * Requests that don't depend on each other can be put into a queue of requests (d_Queue) and waited for at once.
+ * If d_queueDepth is set, the queue is an io_uring (set up by raw system calls) and up to d_queueDepth requests are in
+ * flight at the same time; a registered buffer is used for requests within it. If io_uring is not available (or the
+ * image is mapped), the queued requests are done synchronously.
+ *
+ * In direct mode (d_useDirect) the image is accessed by O_DIRECT, so the data don't go through the page cache. Buffers
+ * of large transfers should be allocated by d_allocBuffer; requests that are not aligned to the logical block size
+ * (its address, position or length) are transferred through an aligned bounce buffer.
  *
  */
 
@@ -28,32 +41,211 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
+#include <libintl.h>
+#include <locale.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 
 #include <disk.h>
 #include <entry.h>
 
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif
+
 /** Descriptor of file image */
 int disk_descriptor = 0;
 
-/** Function mounts disk image (i.e. assigns the parameter into global variable disk_descriptor)
+/** If the image should be mapped into memory when it is mounted */
+int d_useMmap = 0;
+/** The mapped image (NULL if the image is accessed by pread/pwrite) */
+static unsigned char *diskMap = NULL;
+/** Size of the mapped image */
+static size_t diskMapSize = 0;
+/** Range of the mapping changed since the last d_sync (empty if diskDirtyStart >= diskDirtyEnd) */
+static size_t diskDirtyStart = 0, diskDirtyEnd = 0;
+
+/** number of bytes transferred from/to the image (all threads) */
+unsigned long long d_transferred = 0;
+
+/** If the image should be accessed by direct I/O (O_DIRECT) */
+int d_useDirect = 0;
+/** Logical block size of the image in direct mode (0 if the direct mode is not used) */
+static size_t diskBlock = 0;
+
+/** Maximal number of requests in flight in a queue (0 means that queued requests are done synchronously) */
+unsigned int d_queueDepth = 0;
+
+/** Request in flight */
+typedef struct {
+  off_t offset;        /* position in the image */
+  void *buffer;        /* buffer for the data (NULL for vectored request) */
+  const struct iovec *iov;  /* buffers of vectored request */
+  int iovcnt;          /* number of the buffers */
+  size_t size;         /* number of bytes */
+  int write;           /* 1 if the data are written, 0 if they are read */
+  unsigned next;       /* next unused request (list of unused requests) */
+} d_Request;
+
+/** Queue of requests - an io_uring, or nothing (fd = -1) if the requests are done synchronously */
+struct d_Queue {
+  int fd;                          /* descriptor of io_uring, or -1 */
+  unsigned depth;                  /* number of entries of the submission queue */
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe *sqes;       /* submission queue entries */
+  struct io_uring_cqe *cqes;       /* completion queue entries */
+  void *sqRing, *cqRing;           /* mapped rings */
+  size_t sqRingSize, cqRingSize;
+  unsigned toSubmit;               /* number of filled entries that were not submitted yet */
+  unsigned inFlight;               /* number of submitted requests that are not completed */
+  d_Request *requests;             /* requests, indexed by user_data of the entries */
+  unsigned unused;                 /* first unused request (depth = none) */
+  char *fixedBase;                 /* registered buffer (NULL if there is none) */
+  size_t fixedSize;
+  int errors;                      /* number of failed requests since the last d_waitQueue */
+};
+
+/** The function allocates a buffer for disk transfers; it is aligned to the memory page, so it can be used for direct
+ *  I/O. It is freed by free().
+ *  @param size size of the buffer
+ *  @return the buffer
+ */
+void *d_allocBuffer(size_t size)
+{
+  void *buffer = NULL;
+
+  if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), (size) ? size : 1))
+    error(0,_("Out of memory !"));
+  return buffer;
+}
+
+/** The function turns on direct I/O on the image and determines the logical block size. Block devices are asked
+ *  for it (BLKSSZGET); for image files, transfer of a single sector is tried, and if it is refused, page size is used.
+ *  @param st status of the image file
+ */
+static void d_setDirect(struct stat *st)
+{
+  int size;
+  long page = sysconf(_SC_PAGESIZE);
+  void *probe;
+
+  if (fcntl(disk_descriptor, F_SETFL, fcntl(disk_descriptor, F_GETFL) | O_DIRECT))
+    error(0,_("Can't use direct I/O !"));
+  if (S_ISBLK(st->st_mode) && !ioctl(disk_descriptor, BLKSSZGET, &size) && (size > 0))
+    diskBlock = size;
+  else {
+    probe = d_allocBuffer(page);
+    diskBlock = (pread(disk_descriptor, probe, 512, 512) == 512) ? 512 : page;
+    free(probe);
+  }
+  if (debug_mode)
+    fprintf(output_stream, "(d_mount) direct I/O, logical block size: %lu\n", (unsigned long)diskBlock);
+}
+
+/** Function mounts disk image (i.e. assigns the parameter into global variable disk_descriptor). If d_useMmap is set,
+ *  the image is mapped into memory, otherwise if d_useDirect is set, direct I/O is turned on.
  *  @param image_descriptor This parameter will be assigned into disk_descriptor variable
  */
 int d_mount(int image_descriptor)
 {
+  struct stat st;
+
   disk_descriptor = image_descriptor;
+  diskBlock = 0;
+  if (d_useDirect && !d_useMmap) {
+    if (fstat(image_descriptor, &st))
+      error(0,_("Can't use direct I/O !"));
+    d_setDirect(&st);
+  }
+  if (d_useMmap) {
+    if (fstat(image_descriptor, &st) || (st.st_size <= 0))
+      error(0,_("Can't map image into memory !"));
+    diskMapSize = st.st_size;
+    diskMap = (unsigned char *)mmap(NULL, diskMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, image_descriptor, 0);
+    if (diskMap == MAP_FAILED) {
+      diskMap = NULL;
+      error(0,_("Can't map image into memory !"));
+    }
+    /* the defragmentation touches clusters all over the image, read-ahead would be wasted */
+    madvise(diskMap, diskMapSize, MADV_RANDOM);
+    diskDirtyStart = diskDirtyEnd = 0;
+  }
   return 0;
 }
 
 
-/** Un-mounting disk image, the descriptor is zero-ed. */
+/** Un-mounting disk image, the descriptor is zero-ed; the mapped image is written and un-mapped. */
 int d_umount()
 {
+  if (diskMap) {
+    d_sync();
+    munmap(diskMap, diskMapSize);
+    diskMap = NULL;
+    diskMapSize = 0;
+  }
+  diskBlock = 0;
   disk_descriptor = 0;
   return 0;
 }
 
+/** The function writes the changed part of the mapped image (ranged msync). Without the mapping nothing is done,
+ *  the data are written by pwrite immediately.
+ *  @return Returns 0 if there was no error.
+ */
+int d_sync()
+{
+  size_t start;
+  long page = sysconf(_SC_PAGESIZE);
+
+  if (!diskMap || (diskDirtyStart >= diskDirtyEnd)) return 0;
+  start = diskDirtyStart - diskDirtyStart % page;
+  if (msync(diskMap + start, diskDirtyEnd - start, MS_SYNC))
+    return 1;
+  diskDirtyStart = diskDirtyEnd = 0;
+  return 0;
+}
+
+/** The function synchronizes the image - the changed part of the mapped image is written, or the written data are
+ *  flushed to the disk (fdatasync).
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int d_datasync()
+{
+  if (diskMap)
+    return d_sync();
+  return (fdatasync(disk_descriptor)) ? 1 : 0;
+}
+
+/** The function returns address of sectors in the mapped image, so they can be read without copying.
+ *  @param LBAaddress logical LBA address of the first sector
+ *  @param count number of sectors
+ *  @param BPSector Number of bytes per sector
+ *  @return address of the sectors, or NULL if the image is not mapped (or the sectors are out of the image)
+ */
+void *d_address(unsigned long LBAaddress, unsigned long count, unsigned short BPSector)
+{
+  size_t offset = (size_t)LBAaddress * BPSector;
+
+  if (!diskMap || (offset > diskMapSize) || ((size_t)count * BPSector > diskMapSize - offset))
+    return NULL;
+  return diskMap + offset;
+}
+
 /** The function determines if the disk is mounted
     @return If the disk is mounted, return 1, or 0 otherwise. */
 int d_mounted()
@@ -62,6 +254,406 @@ int d_mounted()
   else return 1;
 }
 
+/** The function transfers 'size' bytes between the image and buffer by pread/pwrite, repeating short transfers.
+ *  @param offset position in the image
+ *  @param buffer buffer for the data
+ *  @param size number of bytes
+ *  @param write 1 if the data should be written, 0 if they should be read
+ *  @return number of really transferred bytes
+ */
+static size_t d_transferRaw(off_t offset, void *buffer, size_t size, int write)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < size) {
+    if (write)
+      n = pwrite(disk_descriptor, (char*)buffer + done, size - done, offset + done);
+    else
+      n = pread(disk_descriptor, (char*)buffer + done, size - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += n;
+  }
+  return done;
+}
+
+/** The function determines if a transfer can be done by direct I/O without bounce buffer */
+static int d_aligned(off_t offset, const void *buffer, size_t size)
+{
+  return !(offset % diskBlock) && !((uintptr_t)buffer % diskBlock) && !(size % diskBlock);
+}
+
+/** The function transfers data that are not aligned for direct I/O through an aligned buffer. Blocks that are written
+ *  only partially are read at first.
+ *  @param offset position in the image
+ *  @param buffer buffer for the data
+ *  @param size number of bytes
+ *  @param write 1 if the data should be written, 0 if they should be read
+ *  @return number of really transferred bytes
+ */
+static size_t d_bounce(off_t offset, void *buffer, size_t size, int write)
+{
+  off_t start = offset - offset % diskBlock;
+  size_t head = offset - start, length = (head + size + diskBlock - 1) / diskBlock * diskBlock, done;
+  unsigned char *aligned = (unsigned char *)d_allocBuffer(length);
+
+  if (!write || head || (length != head + size)) {
+    done = d_transferRaw(start, aligned, length, 0);
+    if (done < length)
+      memset(aligned + done, 0, length - done);
+  } else
+    done = length;
+  if (write) {
+    memcpy(aligned + head, buffer, size);
+    done = d_transferRaw(start, aligned, length, 1);
+  } else if (done > head)
+    memcpy(buffer, aligned + head, (done - head < size) ? done - head : size);
+  free(aligned);
+  if (done <= head) return 0;
+  return (done - head < size) ? done - head : size;
+}
+
+/** The function transfers 'size' bytes between the image (from position 'offset') and buffer. The position is
+ *  given explicitly (pread/pwrite), so the file pointer is not used and the function can be called from more threads.
+ *  Short transfers are repeated until all the data is transferred, or an error (or end of the image) occurs.
+ *  If the image is mapped, the data are only copied and the written range is remembered for d_sync. In direct mode
+ *  unaligned transfers go through a bounce buffer.
+ *  @param offset position in the image
+ *  @param buffer buffer for the data
+ *  @param size number of bytes
+ *  @param write 1 if the data should be written, 0 if they should be read
+ *  @return number of really transferred bytes
+ */
+size_t d_transfer(off_t offset, void *buffer, size_t size, int write)
+{
+  if (diskMap) {
+    if ((size_t)offset >= diskMapSize) return 0;
+    if (size > diskMapSize - offset) size = diskMapSize - offset;
+    if (write) {
+      memcpy(diskMap + offset, buffer, size);
+      if (diskDirtyStart >= diskDirtyEnd) {
+        diskDirtyStart = offset;
+        diskDirtyEnd = offset + size;
+      } else {
+        if ((size_t)offset < diskDirtyStart) diskDirtyStart = offset;
+        if (offset + size > diskDirtyEnd) diskDirtyEnd = offset + size;
+      }
+    } else
+      memcpy(buffer, diskMap + offset, size);
+    return size;
+  }
+  if (diskBlock && !d_aligned(offset, buffer, size))
+    return d_bounce(offset, buffer, size, write);
+  return d_transferRaw(offset, buffer, size, write);
+}
+
+/** The function transfers data between continuous area of the image (starting at 'offset') and more buffers
+ *  (preadv/pwritev), at most IOV_MAX buffers by one system call. Short transfers are repeated. If the image is mapped,
+ *  or some buffer is not aligned for direct I/O, the buffers are transferred one by one.
+ *  @param offset position in the image
+ *  @param iov array of buffers; the array is not changed
+ *  @param iovcnt number of buffers
+ *  @param write 1 if the data should be written, 0 if they should be read
+ *  @return number of really transferred bytes
+ */
+size_t d_transferv(off_t offset, const struct iovec *iov, int iovcnt, int write)
+{
+  struct iovec part[IOV_MAX];
+  size_t done = 0, skip;
+  ssize_t n;
+  int first = 0, count, i;
+
+  /* in direct mode all the buffers have to be aligned, otherwise they are transferred one by one */
+  for (i = 0; diskBlock && !diskMap && (i < iovcnt) && d_aligned(offset, iov[i].iov_base, iov[i].iov_len); i++)
+    ;
+  if (diskMap || (diskBlock && (i < iovcnt))) {
+    for (i = 0; i < iovcnt; i++) {
+      n = d_transfer(offset + done, iov[i].iov_base, iov[i].iov_len, write);
+      done += n;
+      if ((size_t)n < iov[i].iov_len) break;
+    }
+    return done;
+  }
+
+  while (first < iovcnt) {
+    count = iovcnt - first;
+    if (count > IOV_MAX) count = IOV_MAX;
+    for (i = 0; i < count; i++)
+      part[i] = iov[first + i];
+
+    for (i = 0; i < count; ) {
+      if (write)
+        n = pwritev(disk_descriptor, part + i, count - i, offset + done);
+      else
+        n = preadv(disk_descriptor, part + i, count - i, offset + done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return done;
+      done += n;
+      /* skips fully transferred buffers, the partially transferred one is shortened */
+      for (skip = n; (i < count) && (skip >= part[i].iov_len); i++)
+        skip -= part[i].iov_len;
+      if (i < count) {
+        part[i].iov_base = (char*)part[i].iov_base + skip;
+        part[i].iov_len -= skip;
+      }
+    }
+    first += count;
+  }
+  return done;
+}
+
+/** The function opens a queue of requests. If d_queueDepth is 0, the image is mapped or io_uring can't be set up,
+ *  the queue does the requests synchronously.
+ *  @return the queue
+ */
+d_Queue *d_openQueue()
+{
+  struct io_uring_params params;
+  d_Queue *q;
+  unsigned i;
+
+  if ((q = (d_Queue *)calloc(1, sizeof(d_Queue))) == NULL)
+    error(0,_("Out of memory !"));
+  q->fd = -1;
+  if (!d_queueDepth || diskMap) return q;
+
+  memset(&params, 0, sizeof(params));
+  if ((q->fd = syscall(__NR_io_uring_setup, d_queueDepth, &params)) < 0) {
+    if (debug_mode)
+      fprintf(output_stream, "(d_openQueue) io_uring is not available, synchronous I/O is used\n");
+    q->fd = -1;
+    return q;
+  }
+  q->depth = params.sq_entries;
+  q->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  q->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  q->sqRing = mmap(NULL, q->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+  q->cqRing = mmap(NULL, q->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING);
+  q->sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+  if ((q->sqRing == MAP_FAILED) || (q->cqRing == MAP_FAILED) || (q->sqes == MAP_FAILED))
+    error(0,_("Can't set up io_uring !"));
+  q->sqHead = (unsigned *)((char *)q->sqRing + params.sq_off.head);
+  q->sqTail = (unsigned *)((char *)q->sqRing + params.sq_off.tail);
+  q->sqMask = (unsigned *)((char *)q->sqRing + params.sq_off.ring_mask);
+  q->sqArray = (unsigned *)((char *)q->sqRing + params.sq_off.array);
+  q->cqHead = (unsigned *)((char *)q->cqRing + params.cq_off.head);
+  q->cqTail = (unsigned *)((char *)q->cqRing + params.cq_off.tail);
+  q->cqMask = (unsigned *)((char *)q->cqRing + params.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *)((char *)q->cqRing + params.cq_off.cqes);
+
+  if ((q->requests = (d_Request *)malloc(q->depth * sizeof(d_Request))) == NULL)
+    error(0,_("Out of memory !"));
+  for (i = 0; i < q->depth; i++)
+    q->requests[i].next = i + 1;
+  q->unused = 0;
+  return q;
+}
+
+/** The function closes the queue (all its requests have to be waited for) */
+void d_closeQueue(d_Queue *q)
+{
+  if (q->fd >= 0) {
+    munmap(q->sqes, q->depth * sizeof(struct io_uring_sqe));
+    munmap(q->cqRing, q->cqRingSize);
+    munmap(q->sqRing, q->sqRingSize);
+    close(q->fd);
+    free(q->requests);
+  }
+  free(q);
+}
+
+/** The function determines if requests of the queue are really asynchronous
+ *  @return 1 if the queue is an io_uring, 0 if the requests are done synchronously */
+int d_queueAsync(d_Queue *q)
+{
+  return (q->fd >= 0) ? 1 : 0;
+}
+
+/** The function registers a buffer of the queue; requests within the buffer don't need to map it each time.
+ *  @param q the queue
+ *  @param buffer the buffer
+ *  @param size size of the buffer
+ *  @return Returns 0 if the buffer was registered.
+ */
+int d_registerBuffer(d_Queue *q, void *buffer, size_t size)
+{
+  struct iovec iov;
+
+  if (q->fd < 0) return 1;
+  iov.iov_base = buffer;
+  iov.iov_len = size;
+  if (syscall(__NR_io_uring_register, q->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+    return 1;
+  q->fixedBase = (char *)buffer;
+  q->fixedSize = size;
+  return 0;
+}
+
+/** The function submits filled entries and waits for at least min completed requests. Completed requests are
+ *  checked; short (or failed) transfers are finished synchronously.
+ *  @param q the queue
+ *  @param min number of requests to wait for
+ */
+static void d_reap(d_Queue *q, unsigned min)
+{
+  unsigned head, tail;
+  struct io_uring_cqe *cqe;
+  d_Request *r;
+  size_t done;
+  int ret;
+
+  do {
+    ret = syscall(__NR_io_uring_enter, q->fd, q->toSubmit, min, (min) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if ((ret < 0) && (errno != EINTR))
+      error(0,_("Can't submit I/O requests !"));
+  } while (ret < 0);
+  q->toSubmit -= ret;
+
+  head = *q->cqHead;
+  tail = __atomic_load_n(q->cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    cqe = &q->cqes[head & *q->cqMask];
+    r = &q->requests[cqe->user_data];
+    done = (cqe->res > 0) ? (size_t)cqe->res : 0;
+    /* the vectored request is done again as a whole */
+    if ((done < r->size) && r->iov)
+      done = d_transferv(r->offset, r->iov, r->iovcnt, r->write);
+    else if (done < r->size)
+      done += d_transfer(r->offset + done, (char *)r->buffer + done, r->size - done, r->write);
+    if (done < r->size)
+      q->errors++;
+    r->next = q->unused;
+    q->unused = cqe->user_data;
+    q->inFlight--;
+  }
+  __atomic_store_n(q->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/** The function puts a request into the submission queue of io_uring.
+ *  @param q the queue (it has to be asynchronous)
+ *  @param offset position in the image
+ *  @param buffer buffer for the data, or NULL for vectored request
+ *  @param iov buffers of vectored request
+ *  @param iovcnt number of the buffers
+ *  @param size number of bytes
+ *  @param write 1 if the data should be written, 0 if they should be read
+ */
+static void d_submit(d_Queue *q, off_t offset, void *buffer, const struct iovec *iov, int iovcnt, size_t size,
+                     int write)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail, index;
+  d_Request *r;
+
+  /* all requests are in flight, at least one has to be completed */
+  while (q->unused == q->depth)
+    d_reap(q, 1);
+  index = q->unused;
+  r = &q->requests[index];
+  q->unused = r->next;
+  r->offset = offset;
+  r->buffer = buffer;
+  r->iov = iov;
+  r->iovcnt = iovcnt;
+  r->size = size;
+  r->write = write;
+
+  tail = *q->sqTail;
+  sqe = &q->sqes[tail & *q->sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = disk_descriptor;
+  sqe->off = r->offset;
+  sqe->user_data = index;
+  if (iov) {
+    sqe->opcode = (write) ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = iovcnt;
+  } else {
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = r->size;
+    if (q->fixedBase && ((char *)buffer >= q->fixedBase) && ((char *)buffer + size <= q->fixedBase + q->fixedSize)) {
+      sqe->opcode = (write) ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->buf_index = 0;
+    } else
+      sqe->opcode = (write) ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  q->sqArray[tail & *q->sqMask] = tail & *q->sqMask;
+  __atomic_store_n(q->sqTail, tail + 1, __ATOMIC_RELEASE);
+  q->toSubmit++;
+  q->inFlight++;
+}
+
+/** The function puts a transfer of sectors into the queue. If the queue is synchronous, the transfer is done now.
+ *  The buffer has to be kept until d_waitQueue, failed transfers are counted by d_waitQueue.
+ *  @param q the queue
+ *  @param LBAaddress logical LBA address of the first sector
+ *  @param buffer buffer for the data
+ *  @param count number of sectors
+ *  @param BPSector Number of bytes per sector
+ *  @param write 1 if the data should be written, 0 if they should be read
+ *  @return Returns 0 if the request was accepted.
+ */
+int d_queueSectors(d_Queue *q, unsigned long LBAaddress, void *buffer, unsigned long count, unsigned short BPSector,
+                   int write)
+{
+  if (!disk_descriptor) return 1;
+  __sync_fetch_and_add(&d_transferred, (unsigned long long)count * BPSector);
+  if (q->fd < 0) {
+    if (d_transfer((off_t)LBAaddress * BPSector, buffer, (size_t)count * BPSector, write) != (size_t)count * BPSector)
+      q->errors++;
+    return 0;
+  }
+  d_submit(q, (off_t)LBAaddress * BPSector, buffer, NULL, 0, (size_t)count * BPSector, write);
+  return 0;
+}
+
+/** The function puts a transfer of continuous sectors from (or into) more buffers into the queue, as single request.
+ *  If the queue is synchronous, the transfer is done now. The buffers and the array of them have to be kept until
+ *  d_waitQueue. Lengths of the buffers have to be multiples of the sector size.
+ *  @param q the queue
+ *  @param LBAaddress logical LBA address of the first sector
+ *  @param iov array of buffers
+ *  @param iovcnt number of buffers
+ *  @param BPSector Number of bytes per sector
+ *  @param write 1 if the data should be written, 0 if they should be read
+ *  @return Returns 0 if the request was accepted.
+ */
+int d_queueSectorsv(d_Queue *q, unsigned long LBAaddress, const struct iovec *iov, int iovcnt,
+                    unsigned short BPSector, int write)
+{
+  size_t size = 0;
+  int i;
+
+  if (!disk_descriptor) return 1;
+  for (i = 0; i < iovcnt; i++)
+    size += iov[i].iov_len;
+  __sync_fetch_and_add(&d_transferred, (unsigned long long)size);
+  if (q->fd < 0) {
+    if (d_transferv((off_t)LBAaddress * BPSector, iov, iovcnt, write) != size)
+      q->errors++;
+    return 0;
+  }
+  d_submit(q, (off_t)LBAaddress * BPSector, NULL, iov, iovcnt, size, write);
+  return 0;
+}
+
+/** The function waits until all requests of the queue are completed.
+ *  @param q the queue
+ *  @return number of requests that failed (since the last call)
+ */
+int d_waitQueue(d_Queue *q)
+{
+  int errors;
+
+  while (q->inFlight)
+    d_reap(q, q->inFlight);
+  errors = q->errors;
+  q->errors = 0;
+  return errors;
+}
+
 /** The function reads 'count' sectors from the image of LBA logicall address into buffer
  *  @param LBAaddress logical LBA address, from that we should read sectors
  *  @param buffer into this buffer the sectors' data are written to
@@ -69,14 +661,14 @@ int d_mounted()
  *  @param BPSector Number of bytes per sector
  *  @return number of really read sectors
  */
-unsigned short d_readSectors(unsigned long LBAaddress, void *buffer, unsigned short count, unsigned short BPSector)
+unsigned long d_readSectors(unsigned long LBAaddress, void *buffer, unsigned long count, unsigned short BPSector)
 {
-  ssize_t size;
+  size_t done;
+
   if (!disk_descriptor) return 0;
-  lseek(disk_descriptor, LBAaddress * BPSector, SEEK_SET);
-  size = read(disk_descriptor, buffer, count * BPSector);
-  
-  return (unsigned short)(size / BPSector);
+  done = d_transfer((off_t)LBAaddress * BPSector, buffer, (size_t)count * BPSector, 0);
+  __sync_fetch_and_add(&d_transferred, (unsigned long long)done);
+  return done / BPSector;
 }
 
 /** The function writes 'count' sectors into the file disk image on the logical LBA address from buffer.
@@ -86,12 +678,48 @@ unsigned short d_readSectors(unsigned long LBAaddress, void *buffer, unsigned sh
  *  @param BPSector Number of bytes per sector
  *  @return number of really written sectors
  */
-unsigned short d_writeSectors(unsigned long LBAaddress, void *buffer, unsigned short count, unsigned short BPSector)
+unsigned long d_writeSectors(unsigned long LBAaddress, void *buffer, unsigned long count, unsigned short BPSector)
+{
+  size_t done;
+
+  if (!disk_descriptor) return 0;
+  done = d_transfer((off_t)LBAaddress * BPSector, buffer, (size_t)count * BPSector, 1);
+  __sync_fetch_and_add(&d_transferred, (unsigned long long)done);
+  return done / BPSector;
+}
+
+/** The function reads continuous sectors from the image of LBA logical address into more buffers (scatter read).
+ *  Lengths of the buffers have to be multiples of the sector size.
+ *  @param LBAaddress logical LBA address, from that we should read sectors
+ *  @param iov array of buffers
+ *  @param iovcnt number of buffers
+ *  @param BPSector Number of bytes per sector
+ *  @return number of really read sectors
+ */
+unsigned long d_readSectorsv(unsigned long LBAaddress, const struct iovec *iov, int iovcnt, unsigned short BPSector)
 {
-  ssize_t size;
+  size_t done;
+
   if (!disk_descriptor) return 0;
-  lseek(disk_descriptor, LBAaddress * BPSector, SEEK_SET);
-  size = write(disk_descriptor, buffer, count * BPSector);
+  done = d_transferv((off_t)LBAaddress * BPSector, iov, iovcnt, 0);
+  __sync_fetch_and_add(&d_transferred, (unsigned long long)done);
+  return done / BPSector;
+}
+
+/** The function writes data from more buffers into continuous sectors of the image (gather write).
+ *  Lengths of the buffers have to be multiples of the sector size.
+ *  @param LBAaddress logical LBA address, where we should write sectors
+ *  @param iov array of buffers
+ *  @param iovcnt number of buffers
+ *  @param BPSector Number of bytes per sector
+ *  @return number of really written sectors
+ */
+unsigned long d_writeSectorsv(unsigned long LBAaddress, const struct iovec *iov, int iovcnt, unsigned short BPSector)
+{
+  size_t done;
 
-  return (unsigned short)(size / BPSector);
+  if (!disk_descriptor) return 0;
+  done = d_transferv((off_t)LBAaddress * BPSector, iov, iovcnt, 1);
+  __sync_fetch_and_add(&d_transferred, (unsigned long long)done);
+  return done / BPSector;
 }
@@ -12,6 +12,50 @@
  * - -h (or --help)                     - Shows information of program usage
  * - -l logfile (or --log_file logfile) - Redirects program messages into log file
  * - -x (or --xmode)                    - Forces the program to work in debug mode (it shows many additional informations)
+ * - -c sectors (or --fat_cache sectors) - Maximal number of changed FAT sectors kept in memory; they are written at the
+ *                                        next checkpoint (by default the FAT is written after defragmentation)
+ * - -p planfile (or --plan planfile)   - Dumps all moves of the defragmentation plan into the file (also in the
+ *                                        analysis mode, so the cost of defragmentation can be estimated)
+ * - -j threads (or --jobs threads)     - Number of threads that scan the directory tree (by default the number of
+ *                                        online processors)
+ * - -s (or --sweep)                    - Quick analysis only; the FAT is read sequentially once and the directory
+ *                                        structure is not traversed
+ * - -m (or --mmap)                     - The image is mapped into memory instead of reading and writing it
+ * - -u depth (or --uring depth)        - Asynchronous I/O by io_uring with up to depth requests in flight (if io_uring
+ *                                        is not available, the program falls back to synchronous I/O)
+ * - -d (or --direct)                   - Direct I/O (O_DIRECT), the data don't go through the page cache (useful
+ *                                        for block devices; it is not used with -m)
+ * - -i file (or --intent file)         - Intent log; original contents of overwritten sectors are saved into the file,
+ *                                        so an interrupted defragmentation is rolled back at the next run (with the
+ *                                        same log)
+ * - -t seconds (or --max-time seconds) - The defragmentation is stopped (on consistent place) when the program runs
+ *                                        longer
+ * - -o megabytes (or --max-io megabytes) - The defragmentation is stopped when more data were read and written
+ * - -r file (or --resume file)         - Number of clusters moved by a stopped defragmentation (by a limit or by
+ *                                        SIGINT/SIGTERM) is saved into the file and reported by the next run with the
+ *                                        file; the next run analyses the image and plans the rest again
+ * - -S (or --selective)                - Only fragmented files and directories are moved (each of them into a free
+ *                                        extent where it fits), contiguous ones stay where they are
+ * - -F count (or --min-fragments count) - Only items with at least count fragments are moved (implies -S)
+ * - -P percent (or --min-fragmentation percent) - Only items fragmented at least for percent are moved (implies -S)
+ * - -z kilobytes (or --min-size kilobytes) - Only items of at least the size are moved (implies -S)
+ * - -Z kilobytes (or --max-size kilobytes) - Only items of at most the size are moved (implies -S)
+ * - -D path (or --under path)          - Only items within the directory of the volume are moved (implies -S; it can be
+ *                                        given more times)
+ * - -L policy (or --layout policy)     - Placement policy: "table" (default; items of a directory precede it) or
+ *                                        "dirs" (each directory precedes its items, in the order of directory entries)
+ * - -g clusters (or --gap clusters)    - Free clusters left behind each directory and each recently modified file, so
+ *                                        they can grow without fragmentation
+ * - -n days (or --recent days)         - Files modified at most so many days before the newest file of the volume are
+ *                                        recently modified (by default 30)
+ * - -w (or --spread)                   - All the free space is spread among the gaps (not with -S)
+ * - -O (or --order-only)               - Clusters of files with backward links are only put into ascending order
+ *                                        (within the clusters of the file), the disk is not compacted
+ * - -T file (or --trace file)          - Access trace; the files (or their ranges) listed in the file are placed first,
+ *                                        in the order of the trace (not with -S or -O). Each line is a path within the
+ *                                        volume, optionally followed by offset and length in bytes (separated by tabs);
+ *                                        without offset the whole file is placed, an offset without length means one
+ *                                        byte (the cluster that holds it)
  *
  */
 
@@ -36,6 +80,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <fcntl.h>
 #include <libintl.h>
 #include <locale.h>
@@ -44,8 +89,11 @@
 #include <version.h>
 #include <entry.h>
 #include <fat32.h>
+#include <disk.h>
 #include <analyze.h>
 #include <defrag.h>
+#include <plan.h>
+#include <intent.h>
 #include "mainpage.h"
 
 /** Name of the program */
@@ -67,7 +115,30 @@ void print_usage(FILE *stream, int exit_code)
 		    "  -l  --log_file nazov_suboru\tSet program output to log file\n"
 		    "  -x  --xmode\t\t\tWork in X mode (debug mode)\n"
                     "  -a  --analyze\t\t\tAnalyze only (not defragment)\n"
-                    "  -f  --force\t\t\tForce the defragmentation\n"));
+                    "  -f  --force\t\t\tForce the defragmentation\n"
+                    "  -c  --fat_cache sectors\tWrite FAT when more sectors are changed\n"
+                    "  -p  --plan file\t\tDump plan of the defragmentation to file\n"
+                    "  -j  --jobs threads\t\tNumber of threads that scan the directories\n"
+                    "  -s  --sweep\t\t\tQuick analysis only (by a linear sweep of FAT)\n"
+                    "  -m  --mmap\t\t\tMap the image into memory\n"
+                    "  -u  --uring depth\t\tAsynchronous I/O with depth requests in flight\n"
+                    "  -d  --direct\t\t\tDirect I/O, bypass the page cache\n"
+                    "  -i  --intent file\t\tIntent log (interrupted defragmentation is rolled back)\n"
+                    "  -t  --max-time seconds\tStop the defragmentation after the time\n"
+                    "  -o  --max-io megabytes\tStop the defragmentation after the amount of I/O\n"
+                    "  -r  --resume file\t\tRecord progress of stopped defragmentation\n"
+                    "  -S  --selective\t\tMove only fragmented files and directories\n"
+                    "  -F  --min-fragments count\tMove only items with at least count fragments\n"
+                    "  -P  --min-fragmentation percent Move only items fragmented at least for percent\n"
+                    "  -z  --min-size kilobytes\tMove only items of at least the size\n"
+                    "  -Z  --max-size kilobytes\tMove only items of at most the size\n"
+                    "  -D  --under path\t\tMove only items within the directory of the volume\n"
+                    "  -L  --layout policy\t\tPlacement policy (table, dirs)\n"
+                    "  -g  --gap clusters\t\tLeave free clusters behind directories and recent files\n"
+                    "  -n  --recent days\t\tFiles modified within the days are recent (default 30)\n"
+                    "  -w  --spread\t\t\tSpread all free space among the gaps\n"
+                    "  -O  --order-only\t\tOnly put clusters of files into ascending order\n"
+                    "  -T  --trace file\t\tPlace files of the access trace first, in its order\n"));
   exit(exit_code);
 }
 
@@ -107,7 +178,9 @@ int main(int argc, char *argv[])
   int next_option; 				/* next parameter */
   int image_descriptor = 0;			/* file descriptor of image */
   const char *log_filename = NULL;		/* name of log file */
-  const char* const short_options = "hl:xaf";	/* string of short parameter names */
+  const char *intent_filename = NULL;		/* name of intent log */
+  const char* const short_options = "hl:xafc:p:j:smu:di:t:o:r:SF:P:z:Z:D:L:g:n:wOT:";	/* string of short parameter names */
+  char *endptr;					/* end of parsed numeric argument */
 
   /* Array of structures that describes long parameter names */
   const struct option long_options[] = {
@@ -116,9 +189,32 @@ int main(int argc, char *argv[])
     { "xmode",		0, NULL, 'x' },
     { "analyze",        0, NULL, 'a' },
     { "force",          0, NULL, 'f' },
+    { "fat_cache",      1, NULL, 'c' },
+    { "plan",           1, NULL, 'p' },
+    { "jobs",           1, NULL, 'j' },
+    { "sweep",          0, NULL, 's' },
+    { "mmap",           0, NULL, 'm' },
+    { "uring",          1, NULL, 'u' },
+    { "direct",         0, NULL, 'd' },
+    { "intent",         1, NULL, 'i' },
+    { "max-time",       1, NULL, 't' },
+    { "max-io",         1, NULL, 'o' },
+    { "resume",         1, NULL, 'r' },
+    { "selective",      0, NULL, 'S' },
+    { "min-fragments",  1, NULL, 'F' },
+    { "min-fragmentation", 1, NULL, 'P' },
+    { "min-size",       1, NULL, 'z' },
+    { "max-size",       1, NULL, 'Z' },
+    { "under",          1, NULL, 'D' },
+    { "layout",         1, NULL, 'L' },
+    { "gap",            1, NULL, 'g' },
+    { "recent",         1, NULL, 'n' },
+    { "spread",         0, NULL, 'w' },
+    { "order-only",     0, NULL, 'O' },
+    { "trace",          1, NULL, 'T' },
     { NULL,		0, NULL, 0 }		/* Needed for to determine end of the array */
   };
-  Oflags flags = { 0,0,0,0,0 };			/* flags of the program switches */
+  Oflags flags = {0};				/* flags of the program switches */
 
   /* Sets up the message domain */
   setlocale(LC_ALL, "");
@@ -128,6 +224,7 @@ int main(int argc, char *argv[])
   output_stream = stdout;			/* for start, the output is on the screen */
   /* Real name of the program is stored in order to be possible to use it in various messages of the program */
   program_name = argv[0];
+  def_startTime = time(NULL);
   opterr = 0; /* Force the getopt_long function for not showing error messages */
   do {
     next_option = getopt_long(argc, argv, short_options, long_options, NULL);
@@ -148,6 +245,104 @@ int main(int argc, char *argv[])
       case 'f': /* -f or --force */
         flags.f_force = 1;
         break;
+      case 'c': /* -c or --fat_cache */
+        f32_dirtyLimit = strtoul(optarg, &endptr, 10);
+        if (*endptr || !f32_dirtyLimit)
+          error(0,_("Wrong number of FAT cache sectors: %s"), optarg);
+        break;
+      case 'p': /* -p or --plan */
+        pl_dumpFile = optarg;
+        break;
+      case 'j': /* -j or --jobs */
+        an_jobs = strtoul(optarg, &endptr, 10);
+        if (*endptr || !an_jobs)
+          error(0,_("Wrong number of threads: %s"), optarg);
+        break;
+      case 's': /* -s or --sweep */
+        flags.f_sweep = 1;
+        break;
+      case 'm': /* -m or --mmap */
+        d_useMmap = 1;
+        break;
+      case 'u': /* -u or --uring */
+        d_queueDepth = strtoul(optarg, &endptr, 10);
+        if (*endptr || !d_queueDepth)
+          error(0,_("Wrong queue depth: %s"), optarg);
+        break;
+      case 'd': /* -d or --direct */
+        d_useDirect = 1;
+        break;
+      case 'i': /* -i or --intent */
+        intent_filename = optarg;
+        flags.f_intent = 1;
+        break;
+      case 't': /* -t or --max-time */
+        def_maxTime = strtoul(optarg, &endptr, 10);
+        if (*endptr || !def_maxTime)
+          error(0,_("Wrong time limit: %s"), optarg);
+        break;
+      case 'o': /* -o or --max-io */
+        def_maxIO = strtoull(optarg, &endptr, 10) << 20;
+        if (*endptr || !def_maxIO)
+          error(0,_("Wrong I/O limit: %s"), optarg);
+        break;
+      case 'r': /* -r or --resume */
+        def_resumeFile = optarg;
+        break;
+      case 'S': /* -S or --selective */
+        pl_selective = 1;
+        break;
+      case 'F': /* -F or --min-fragments */
+        pl_minFragments = strtoul(optarg, &endptr, 10);
+        if (*endptr)
+          error(0,_("Wrong number of fragments: %s"), optarg);
+        pl_selective = 1;
+        break;
+      case 'P': /* -P or --min-fragmentation */
+        pl_minFragmentation = strtof(optarg, &endptr);
+        if (*endptr || (pl_minFragmentation < 0.0) || (pl_minFragmentation > 100.0))
+          error(0,_("Wrong fragmentation: %s"), optarg);
+        pl_selective = 1;
+        break;
+      case 'z': /* -z or --min-size */
+        pl_minSize = strtoull(optarg, &endptr, 10) << 10;
+        if (*endptr)
+          error(0,_("Wrong size: %s"), optarg);
+        pl_selective = 1;
+        break;
+      case 'Z': /* -Z or --max-size */
+        pl_maxSize = strtoull(optarg, &endptr, 10) << 10;
+        if (*endptr || !pl_maxSize)
+          error(0,_("Wrong size: %s"), optarg);
+        pl_selective = 1;
+        break;
+      case 'D': /* -D or --under */
+        pl_addUnder(optarg);
+        break;
+      case 'L': /* -L or --layout */
+        if (pl_setPolicy(optarg))
+          error(0,_("Unknown placement policy: %s"), optarg);
+        break;
+      case 'g': /* -g or --gap */
+        pl_gap = strtoul(optarg, &endptr, 10);
+        if (*endptr)
+          error(0,_("Wrong gap: %s"), optarg);
+        break;
+      case 'n': /* -n or --recent */
+        pl_recentDays = strtoul(optarg, &endptr, 10);
+        if (*endptr)
+          error(0,_("Wrong number of days: %s"), optarg);
+        break;
+      case 'w': /* -w or --spread */
+        pl_spread = 1;
+        break;
+      case 'O': /* -O or --order-only */
+        pl_orderOnly = 1;
+        break;
+      case 'T': /* -T or --trace */
+        pl_traceFile = optarg;
+        flags.f_trace = 1;
+        break;
       case '?':
         /* Wrong parameter */
 	error(0,_("Wrong option, use -h or --help"));
@@ -158,6 +353,9 @@ int main(int argc, char *argv[])
     }
   } while (next_option != -1);
 
+  if (flags.f_trace && (pl_selective || pl_orderOnly))
+    error(0,_("Access trace can't be used in selective or order-only mode"));
+
   /* If log file is used, the stdout needed to be redirected to it */
   if (flags.f_logfile)
     if ((output_stream = fopen(log_filename,"w")) == NULL)
@@ -185,20 +383,51 @@ int main(int argc, char *argv[])
   /* mounting the image */
   f32_mount(image_descriptor);
 
+  /* interrupted defragmentation is rolled back, then the FAT has to be loaded again */
+  if (flags.f_intent && in_open(intent_filename)) {
+    f32_umount();
+    f32_mount(image_descriptor);
+  }
+
+  /* quick analysis does not traverse the directories, there is nothing to defragment by */
+  if (flags.f_sweep) {
+    an_sweepFAT();
+    in_close();
+    f32_umount();
+    close(image_descriptor);
+    return 0;
+  }
+
   /* analysis of the disk fragmentation */
   an_analyze();
 
-  /* if the disk is fragmented from min. 1% */
+  /* in analysis mode only the plan of defragmentation is computed */
+  if (flags.f_analyze) {
+    pl_plan();
+    pl_print(output_stream);
+    pl_free();
+  }
+
+  /* if the disk is fragmented from min. 1% (in selective mode the items are selected one by one; other layouts than
+     the default one change also a defragmented disk) */
   if (!flags.f_analyze) {
-    if (flags.f_force || ((int)diskFragmentation > 0))
+    if (flags.f_force || pl_selective || pl_traceFile || strcmp(pl_policy->name, "table") || pl_gap || pl_spread ||
+        ((int)diskFragmentation > 0)) {
+      /* without the log an interrupted chain (or the whole batch, if -c is given) can't be repaired */
+      if (!flags.f_intent)
+        fprintf(output_stream, (f32_dirtyLimit)
+                ? gettext("Warning: no intent log (-i) is used, a crash can damage all files moved since the last "
+                          "FAT write.\n")
+                : gettext("Warning: no intent log (-i) is used, a crash can damage the files being moved.\n"));
       /** the defragmentation itself */
       def_defragTable();
-    else
+    } else
       fprintf(output_stream, gettext("Disk doesn't need defragmentation.\n"));
   }
 
   /* un-mounting the image, freeing memory */
   an_freeTable();
+  in_close();
   f32_umount();
 
   close(image_descriptor);
@@ -7,9 +7,11 @@
  * reading and writing of FAT values, reading and writing clusters and so on. The module directly uses functions of disk.c
  * module; it can be assumed as a higher-level module.
  *
- * One another interesting thing: For reading and writing values into FAT table the cache is used that contains the whole
- * sector that includes a value that it is working with. This cache is updated if the working value is out of the range.
- * It helps to faster work of the defragmenter.
+ * One another interesting thing: the whole active FAT table is loaded into memory when the file system is mounted.
+ * Reading and writing of FAT values works only with this memory image; changed sectors are only marked as dirty and
+ * they are written back (in large continuous blocks) by f32_flushFAT. Together with the FAT there is kept also
+ * a reverse-link table (parent of each cluster in its chain), so the parent of a cluster can be found immediately,
+ * without scanning the whole FAT.
  *
  */
 
@@ -39,6 +41,8 @@
 #include <entry.h>
 #include <disk.h>
 #include <fat32.h>
+#include <space.h>
+#include <intent.h>
 
 /** global variable BIOS Parameter Block */
 F32_BPB bpb;
@@ -46,8 +50,25 @@ F32_BPB bpb;
     area, etc.) */
 F32_Info info;
 
-unsigned long *cacheFsec; /** cache for the single sector of FAT table */
-static unsigned short cacheFindex = 0; /** number of cached sector (log.LBA) */
+/** maximal number of sectors transferred by one disk operation when the FAT is loaded or flushed */
+#define F32_FAT_CHUNK 0x4000
+
+/** in-memory image of the active FAT table */
+unsigned long *FATtable = NULL;
+/** bitmap of free clusters (the bit of a cluster is set if the cluster is free); it is updated by f32_writeFAT */
+unsigned long *FATfree = NULL;
+/** reverse links: FATparent[x] is the cluster that points at x in FAT (0 if there is no such cluster) */
+unsigned long *FATparent = NULL;
+/** dirty flags of FAT sectors (1 if the sector was changed and not written yet) */
+static unsigned char *FATdirty = NULL;
+/** number of FAT entries in the memory image */
+static unsigned long FATentries = 0;
+/** number of dirty FAT sectors */
+static unsigned long FATdirtyCount = 0;
+/** Maximal number of dirty FAT sectors that can be kept in memory; if it is reached, the FAT is written at the next
+    checkpoint (f32_checkpoint). Value 0 means that the FAT is written at every checkpoint if the intent log is not
+    used (nothing could repair an interrupted batch), and only when the log is full otherwise. */
+unsigned long f32_dirtyLimit = 0;
 
 /** The function determines the FAT type and fills up the info structure; bpb must be loaded already.
   * Type of the FAT can be correctly determined (according to Microsoft) only by the number of clusters in FAT.
@@ -81,10 +102,103 @@ int f32_determineFATType()
 }
 
 
+/** The function loads whole active FAT table into memory and builds the reverse-link table (FATparent) and the
+ *  bitmap of free clusters (FATfree).
+ *  The FAT is read in large blocks (F32_FAT_CHUNK sectors at once). Values that does not point into the data area
+ *  (free, bad, last clusters) have no parent. In a case of cross referrences the last found parent is remembered.
+ */
+void f32_loadFAT()
+{
+  unsigned long sector, count, cluster, val;
+
+  FATentries = info.FATsize * info.fSecClusters;
+  FATtable = (unsigned long *)d_allocBuffer(FATentries * sizeof(unsigned long));
+  if ((FATparent = (unsigned long *)calloc(FATentries, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((FATdirty = (unsigned char *)calloc(info.FATsize, sizeof(unsigned char))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((FATfree = (unsigned long *)calloc(F32_BITMAP_WORDS, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+
+  for (sector = 0; sector < info.FATsize; sector += count) {
+    count = info.FATsize - sector;
+    if (count > F32_FAT_CHUNK) count = F32_FAT_CHUNK;
+    if (d_readSectors(info.FATstart + sector, FATtable + sector * info.fSecClusters, count, info.BPSector) != count)
+      error(0,_("Can't read from image (pos.:0x%lx)!"), info.FATstart + sector);
+  }
+
+  for (cluster = 2; (cluster <= info.clusterCount) && (cluster < FATentries); cluster++) {
+    val = FATtable[cluster] & 0x0fffffff;
+    if (F32_FREE(val))
+      FATfree[cluster / F32_WORD_BITS] |= 1UL << (cluster % F32_WORD_BITS);
+    if ((val >= 2) && (val <= info.clusterCount) && (val < FATentries))
+      FATparent[val] = cluster;
+  }
+}
+
+/** The function writes all dirty FAT sectors back into the disk image. Continuous blocks of dirty sectors are
+ *  written at once (max. F32_FAT_CHUNK sectors). If FAT mirroring is turned on, the blocks are written also into
+ *  all other FAT copies.
+ *  @return Returns 0 if there was no error.
+ */
+int f32_flushFAT()
+{
+  unsigned long sector, count, copy;
+
+  if (!f32_mounted()) return 1;
+
+  /* original FAT sectors are saved into the intent log at first */
+  for (sector = 0; sector < info.FATsize; sector++)
+    if (FATdirty[sector])
+      for (copy = 0; copy < ((info.FATmirroring) ? bpb.BPB_NumFATs : 1); copy++)
+        in_protect(info.FATstart + copy * info.FATsize + sector, 1, NULL);
+  if (in_sync())
+    return 1;
+
+  for (sector = 0; sector < info.FATsize; sector += count) {
+    if (!FATdirty[sector]) { count = 1; continue; }
+    for (count = 1; (sector + count < info.FATsize) && FATdirty[sector + count] && (count < F32_FAT_CHUNK); count++)
+      ;
+    if (d_writeSectors(info.FATstart + sector, FATtable + sector * info.fSecClusters, count, info.BPSector) != count)
+      error(0,_("Can't write to image (pos.:0x%lx) !"), info.FATstart + sector);
+    if (info.FATmirroring)
+      for (copy = 1; copy < bpb.BPB_NumFATs; copy++)
+        if (d_writeSectors(info.FATstart + copy * info.FATsize + sector, FATtable + sector * info.fSecClusters, count,
+                           info.BPSector) != count)
+          return 1;
+    memset(FATdirty + sector, 0, count);
+    FATdirtyCount -= count;
+  }
+  return 0;
+}
+
+/** The function is called on consistent places (checkpoints) of the defragmentation. If the checkpoint is due
+ *  (see f32_checkpointDue), all dirty FAT sectors are written by f32_flushFAT, the image is synchronized and the batch
+ *  of the intent log is committed.
+ *  @return Returns 0 if there was no error.
+ */
+int f32_checkpoint()
+{
+  if (f32_checkpointDue())
+    return f32_flushFAT() || d_datasync() || in_commit();
+  return 0;
+}
+
+/** The function determines if the next checkpoint will write the FAT.
+ *  @return 1 if the number of dirty FAT sectors reached f32_dirtyLimit, the intent log is full, or neither the limit
+ *          nor the log is used (then every checkpoint writes the FAT); 0 otherwise.
+ */
+int f32_checkpointDue()
+{
+  if (!f32_dirtyLimit && !in_enabled())
+    return 1;
+  return ((f32_dirtyLimit && (FATdirtyCount >= f32_dirtyLimit)) || in_batchFull()) ? 1 : 0;
+}
+
 /** Mounting the FAT32 file system, it means actually:
  *  -# to determine if the FS is really FAT32
  *  -# to get additional information about FAT (fill F32_Info structure)
- *  -# allocate memory for cache
+ *  -# load the active FAT table into memory
  *
  * @return It returns 0 if there was no error.
  */
@@ -137,8 +251,8 @@ int f32_mount(int image_descriptor)
   if (debug_mode) {
     fprintf(output_stream, "(f32_mount) FAT mirroring: %s\n", (info.FATmirroring)?"yes":"no");
   }
-  if ((cacheFsec = (unsigned long *)malloc(sizeof(unsigned long) * info.fSecClusters)) == NULL)
-    error(0,_("Out of memory !"));
+  f32_loadFAT();
+  sp_build();
 
   return 0;
 }
@@ -152,82 +266,116 @@ int f32_mounted()
   else return 0;
 }
 
-/** Function un-mounts the FAT, i.e. zero-es FATstart, frees cache memory and un-mounts the disk */
+/** Function un-mounts the FAT, i.e. writes dirty FAT sectors, zero-es FATstart, frees FAT memory and un-mounts
+ *  the disk */
 int f32_umount()
 {
+  if (f32_flushFAT())
+    error(0,_("Can't write FAT !"));
   info.FATstart = 0;
-  free(cacheFsec);
+  sp_free();
+  free(FATdirty);
+  free(FATparent);
+  free(FATfree);
+  free(FATtable);
+  FATdirty = NULL;
+  FATfree = NULL;
+  FATdirtyCount = 0;
+  FATparent = NULL;
+  FATtable = NULL;
   d_umount();
   return 0;
 }
 
-/** The function reads the value of a cluster in the FAT table (returns it in value variable), it uses cache of the FAT.
- *  There is implemented only FAT32 version, i.e. the function is not usable for FAT12/16.
+/** The function reads the value of a cluster in the FAT table (returns it in value variable), it uses memory image
+ *  of the FAT. There is implemented only FAT32 version, i.e. the function is not usable for FAT12/16.
  *  @param cluster number of cluster that value will be read from FAT
  *  @param value[output] into this pointer the read value will be stored
  *  @return It returns 0 if there was no error.
  */
 int f32_readFAT(unsigned long cluster, unsigned long *value)
 {
-  unsigned long logicalLBA;
-  unsigned short index;
-  unsigned long val;
-  
   if (!f32_mounted()) return 1;
   
-  logicalLBA = info.FATstart + ((cluster * 4) / info.BPSector); /* FAT sector that contains the cluster */
-  index = (cluster % info.fSecClusters); /* index in the sector of FAT table */
-  if (logicalLBA > (info.FATstart + info.FATsize))
+  if (cluster >= FATentries)
     error(0,_("Trying to read cluster > max !"));
 
-  if (cacheFindex != logicalLBA) {
-    if (d_readSectors(logicalLBA, cacheFsec, 1, info.BPSector) != 1) error(0,_("Can't read from image (pos.:0x%lx)!"), logicalLBA);
-    else cacheFindex = logicalLBA;
-  }
-
-  val = cacheFsec[index] & 0x0fffffff;
-  *value = val;
+  *value = FATtable[cluster] & 0x0fffffff;
   return 0;
 }
 
-/** The function writes the value of a cluster into FAT table, it uses cache of the FAT.
- *  It is implemented only FAT32 version, i.e. the function is not usable for FAT12/16. If FAT mirrorring
- *  is turned on, the value is also written into the second FAT copy (there are assumed only two copies).
+/** The function writes the value of a cluster into memory image of the FAT table, the sector is only marked as
+ *  dirty (it is written by f32_flushFAT). It is implemented only FAT32 version, i.e. the function is not usable for
+ *  FAT12/16. The reverse-link table, the bitmap of free clusters and the index of free extents are updated, too.
  *  @param cluster number of a cluster
  *  @param value the data that will be written into the FAT
  *  @return Returns 0 if there was no error.
  */
 int f32_writeFAT(unsigned long cluster, unsigned long value)
 {
-  unsigned long logicalLBA;
-  unsigned short index;
+  unsigned long old;
 
   if (!f32_mounted()) return 1;
     
   value &= 0x0fffffff;
-  logicalLBA = info.FATstart + ((cluster * 4) / info.BPSector);
-  index = (cluster % info.fSecClusters); /* index in FAT table sector */
-  if (logicalLBA > (info.FATstart + info.FATsize))
+  if (cluster >= FATentries)
     error(0,_("Trying to write cluster > max !"));
-  
-  if (cacheFindex != logicalLBA) {
-    if (d_readSectors(logicalLBA, cacheFsec, 1, info.BPSector) != 1) error(0,_("Can't read from image (pos.:0x%lx) !"), logicalLBA);
-    else cacheFindex = logicalLBA;
-  }
-  cacheFsec[index] = cacheFsec[index] & 0xf0000000;
-  cacheFsec[index] = cacheFsec[index] | value;
 
-  if (d_writeSectors(logicalLBA, cacheFsec, 1, info.BPSector) != 1)
-    error(0,_("Can't write to image (pos.:0x%lx) !"), logicalLBA);
+  /* the old follower loses its parent (only if no other cluster took it in the meantime) */
+  old = FATtable[cluster] & 0x0fffffff;
+  if ((old < FATentries) && (FATparent[old] == cluster))
+    FATparent[old] = 0;
+  if ((value >= 2) && (value <= info.clusterCount) && (value < FATentries))
+    FATparent[value] = cluster;
 
-  if (info.FATmirroring)
-    /* there is assumed only 2 copies of FAT */
-    if (d_writeSectors(logicalLBA + info.FATsize, cacheFsec, 1, info.BPSector) != 1)
-      return 1;
-  
+  FATtable[cluster] = (FATtable[cluster] & 0xf0000000) | value;
+  if ((cluster >= 2) && (cluster <= info.clusterCount) && (F32_FREE(value) != F32_FREE(old))) {
+    if (F32_FREE(value)) {
+      FATfree[cluster / F32_WORD_BITS] |= 1UL << (cluster % F32_WORD_BITS);
+      sp_release(cluster, 1);
+    } else {
+      FATfree[cluster / F32_WORD_BITS] &= ~(1UL << (cluster % F32_WORD_BITS));
+      sp_allocate(cluster, 1);
+    }
+  }
+  if (!FATdirty[cluster / info.fSecClusters]) {
+    FATdirty[cluster / info.fSecClusters] = 1;
+    FATdirtyCount++;
+  }
   return 0;
 }
 
+/** The function finds the first set bit of a cluster bitmap (e.g. FATfree) from the given cluster. The bitmap is
+ *  searched by whole words, so empty words (F32_WORD_BITS clusters) are skipped at once.
+ *  @param bitmap the bitmap of clusters (F32_BITMAP_WORDS words)
+ *  @param begin from where we should start to search
+ *  @return number of the found cluster or 0 if there is none up to the last cluster
+ */
+unsigned long f32_nextBit(const unsigned long *bitmap, unsigned long begin)
+{
+  unsigned long w, word, last = info.clusterCount / F32_WORD_BITS;
+
+  if (begin > info.clusterCount) return 0;
+  w = begin / F32_WORD_BITS;
+  word = bitmap[w] & (~0UL << (begin % F32_WORD_BITS));
+  while (!word) {
+    if (++w > last) return 0;
+    word = bitmap[w];
+  }
+  begin = w * F32_WORD_BITS + __builtin_ctzl(word);
+  return (begin <= info.clusterCount) ? begin : 0;
+}
+
+/** The function returns the parent of the cluster (the cluster that points at it in FAT).
+ *  @param cluster number of a cluster
+ *  @return number of the parent cluster or 0 if the cluster has no parent (it is starting, or free)
+ */
+unsigned long f32_getParent(unsigned long cluster)
+{
+  if (!f32_mounted() || (cluster >= FATentries)) return 0;
+  return FATparent[cluster];
+}
+
 /** The function computes starting cluster from the dir entry, (note: For FAT12/16 this does not need to be computed, because there is used maximum 16-bit value. Within FAT32 the starting cluster is split into a structure of two 16-bit items and they need to be "concatenated" in appropriate way).
   * @param entry structure of dir entry
   * @return computed starting cluster
@@ -266,36 +414,191 @@ unsigned long f32_getNextCluster(unsigned long cluster)
  *  @return In a case of error, it returns 1; 0 otherwise.
  */
 int f32_readCluster(unsigned long cluster, void *buffer)
+{
+  return f32_readClusters(cluster, 1, buffer);
+}
+
+/** The function writes all the cluster from the memory into the disk image (data, not FAT value). Required information it takes from already filled structure F32_info (e.g. sectors per cluster, etc.).
+ *  @param cluster number of cluster for writing
+ *  @param buffer pointer to the buffer from what the data will be read
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int f32_writeCluster(unsigned long cluster, void *buffer)
+{
+  return f32_writeClusters(cluster, 1, buffer);
+}
+
+/** The function returns address of the cluster data in the mapped image (see d_address), so the data can be read
+ *  without copying.
+ *  @param cluster number of the cluster
+ *  @return address of the data or NULL if the image is not mapped
+ */
+void *f32_clusterAddress(unsigned long cluster)
+{
+  if (!f32_mounted() || (cluster < 2) || (cluster > info.clusterCount)) return NULL;
+  return d_address(info.firstDataSector + (cluster - 2) * bpb.BPB_SecPerClus, bpb.BPB_SecPerClus, info.BPSector);
+}
+
+/** The function reads run of continuous clusters into memory by single disk operation.
+ *  @param cluster number of the first cluster of the run
+ *  @param count number of clusters in the run
+ *  @param buffer[output] pointer to the buffer (of count clusters) where the data would be pushed
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int f32_readClusters(unsigned long cluster, unsigned long count, void *buffer)
 {
   unsigned long logicalLBA;
   if (!f32_mounted()) return 1;
   
-  if (cluster > info.clusterCount)
+  if (cluster + count - 1 > info.clusterCount)
     error(0,_("Trying to read cluster > max !"));
 
   logicalLBA = info.firstDataSector + (cluster - 2) * bpb.BPB_SecPerClus;
-  if (d_readSectors(logicalLBA, buffer, bpb.BPB_SecPerClus, info.BPSector) != bpb.BPB_SecPerClus)
+  if (d_readSectors(logicalLBA, buffer, count * bpb.BPB_SecPerClus, info.BPSector) != count * bpb.BPB_SecPerClus)
     return 1;
   else
     return 0;
 }
 
-/** The function writes all the cluster from the memory into the disk image (data, not FAT value). Required information it takes from already filled structure F32_info (e.g. sectors per cluster, etc.).
- *  @param cluster number of cluster for writing
- *  @param buffer pointer to the buffer from what the data will be read
+/** The function writes run of continuous clusters from memory into the disk image by single disk operation.
+ *  @param cluster number of the first cluster of the run
+ *  @param count number of clusters in the run
+ *  @param buffer pointer to the buffer (of count clusters) from what the data will be read
  *  @return In a case of error, it returns 1; 0 otherwise.
  */
-int f32_writeCluster(unsigned long cluster, void *buffer)
+int f32_writeClusters(unsigned long cluster, unsigned long count, void *buffer)
 {
   unsigned long logicalLBA;
   if (!f32_mounted()) return 1;
  
-  if (cluster > info.clusterCount)
+  if (cluster + count - 1 > info.clusterCount)
     error(0,_("Trying to write cluster > max !"));
   
   logicalLBA = info.firstDataSector + (cluster - 2) * bpb.BPB_SecPerClus;
-  if (d_writeSectors(logicalLBA, buffer, bpb.BPB_SecPerClus, info.BPSector) != bpb.BPB_SecPerClus)
+  in_protect(logicalLBA, count * bpb.BPB_SecPerClus, NULL);
+  if (in_sync())
+    return 1;
+  if (d_writeSectors(logicalLBA, buffer, count * bpb.BPB_SecPerClus, info.BPSector) != count * bpb.BPB_SecPerClus)
     return 1;
   else
     return 0;
 }
+
+/** The function reads run of continuous clusters into more buffers (each buffer has size of one cluster) by
+ *  single disk operation.
+ *  @param cluster number of the first cluster of the run
+ *  @param count number of clusters in the run (and number of buffers)
+ *  @param buffers[output] array of pointers to the buffers
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int f32_readClustersv(unsigned long cluster, unsigned long count, void **buffers)
+{
+  return f32_transferClustersv(cluster, count, buffers, 0);
+}
+
+/** The function writes run of continuous clusters from more buffers (each buffer has size of one cluster) by
+ *  single disk operation.
+ *  @param cluster number of the first cluster of the run
+ *  @param count number of clusters in the run (and number of buffers)
+ *  @param buffers array of pointers to the buffers
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int f32_writeClustersv(unsigned long cluster, unsigned long count, void **buffers)
+{
+  return f32_transferClustersv(cluster, count, buffers, 1);
+}
+
+/** Common part of f32_readClustersv and f32_writeClustersv.
+ *  @param cluster number of the first cluster of the run
+ *  @param count number of clusters in the run (and number of buffers)
+ *  @param buffers array of pointers to the buffers
+ *  @param write 1 if the clusters should be written, 0 if they should be read
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int f32_transferClustersv(unsigned long cluster, unsigned long count, void **buffers, int write)
+{
+  struct iovec *iov;
+  unsigned long logicalLBA, i, done;
+  if (!f32_mounted()) return 1;
+
+  if (cluster + count - 1 > info.clusterCount)
+    error(0,(write) ? _("Trying to write cluster > max !") : _("Trying to read cluster > max !"));
+
+  if ((iov = (struct iovec *)malloc(count * sizeof(struct iovec))) == NULL)
+    error(0,_("Out of memory !"));
+  for (i = 0; i < count; i++) {
+    iov[i].iov_base = buffers[i];
+    iov[i].iov_len = bpb.BPB_SecPerClus * info.BPSector;
+  }
+  logicalLBA = info.firstDataSector + (cluster - 2) * bpb.BPB_SecPerClus;
+  if (write) {
+    in_protect(logicalLBA, count * bpb.BPB_SecPerClus, NULL);
+    if (in_sync()) {
+      free(iov);
+      return 1;
+    }
+  }
+  if (write)
+    done = d_writeSectorsv(logicalLBA, iov, count, info.BPSector);
+  else
+    done = d_readSectorsv(logicalLBA, iov, count, info.BPSector);
+  free(iov);
+  return (done != count * bpb.BPB_SecPerClus) ? 1 : 0;
+}
+
+/** The function puts a transfer of run of continuous clusters into the queue of requests (see d_queueSectors); the
+ *  result is known after d_waitQueue.
+ *  @param q the queue
+ *  @param cluster number of the first cluster of the run
+ *  @param count number of clusters in the run
+ *  @param buffer buffer of count clusters
+ *  @param write 1 if the clusters should be written, 0 if they should be read
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int f32_queueClusters(d_Queue *q, unsigned long cluster, unsigned long count, void *buffer, int write)
+{
+  if (!f32_mounted()) return 1;
+
+  if (cluster + count - 1 > info.clusterCount)
+    error(0,(write) ? _("Trying to write cluster > max !") : _("Trying to read cluster > max !"));
+
+  if (write) {
+    in_protect(info.firstDataSector + (cluster - 2) * bpb.BPB_SecPerClus, count * bpb.BPB_SecPerClus, NULL);
+    if (in_sync())
+      return 1;
+  }
+  return d_queueSectors(q, info.firstDataSector + (cluster - 2) * bpb.BPB_SecPerClus, buffer,
+                        count * bpb.BPB_SecPerClus, info.BPSector, write);
+}
+
+/** The function puts a transfer of run of continuous clusters from (or into) more buffers (each buffer has size of
+ *  one cluster) into the queue as single request (see d_queueSectorsv); the result is known after d_waitQueue.
+ *  @param q the queue
+ *  @param cluster number of the first cluster of the run
+ *  @param count number of clusters in the run (and number of buffers)
+ *  @param buffers array of pointers to the buffers
+ *  @param iov array of count items, filled by the function; it has to be kept until d_waitQueue
+ *  @param write 1 if the clusters should be written, 0 if they should be read
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int f32_queueClustersv(d_Queue *q, unsigned long cluster, unsigned long count, void **buffers, struct iovec *iov,
+                       int write)
+{
+  unsigned long logicalLBA, i;
+  if (!f32_mounted()) return 1;
+
+  if (cluster + count - 1 > info.clusterCount)
+    error(0,(write) ? _("Trying to write cluster > max !") : _("Trying to read cluster > max !"));
+
+  for (i = 0; i < count; i++) {
+    iov[i].iov_base = buffers[i];
+    iov[i].iov_len = bpb.BPB_SecPerClus * info.BPSector;
+  }
+  logicalLBA = info.firstDataSector + (cluster - 2) * bpb.BPB_SecPerClus;
+  if (write) {
+    in_protect(logicalLBA, count * bpb.BPB_SecPerClus, NULL);
+    if (in_sync())
+      return 1;
+  }
+  return d_queueSectorsv(q, logicalLBA, iov, (int)count, info.BPSector, write);
+}
@@ -25,21 +25,36 @@
 #ifndef __ANALYZE__
 #define __ANALYZE__
 
-  /* Item in a table of fragmented files/directories */
+  /* Continuous run of clusters of a file/directory */
+  typedef struct {
+    unsigned long start;	/* first cluster of the run */
+    unsigned long length;	/* number of clusters in the run */
+  } anExtent;
+
+  /* Item in a table of fragmented files/directories (starting cluster and number of clusters of the item are
+     stored separately, in aStartCluster and aClusterCount arrays) */
   typedef struct {
     unsigned long entryCluster;	/* number of cluster where file entry is located */
+    unsigned long extentIndex;	/* index of the first extent of the item in anExtents */
+    unsigned long extentCount;	/* number of extents of the item */
+    unsigned long modified;	/* date (high word) and time of the last modification from the directory entry */
     unsigned short entryIndex;	/* number of an entry in cluster */
-    unsigned long startCluster;	/* number of starting sector */
-    unsigned long clusterCount; /* number of clusters */
     unsigned char isDir;        /* whether it is directory or file */
-  } __attribute__((packed)) aTableItem;
+  } aTableItem;
 
   extern aTableItem *aTable;
+  extern unsigned long *aStartCluster;
+  extern unsigned long *aClusterCount;
+  extern unsigned long *aParent;
   extern unsigned long tableCount;
+  extern anExtent *anExtents;
+  extern unsigned long anExtentCount;
   extern float diskFragmentation;
   extern unsigned long usedClusters;
+  extern unsigned int an_jobs;
 
   int an_analyze();
+  int an_sweepFAT();
   void an_freeTable();
   
 #endif
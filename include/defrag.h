@@ -25,6 +25,13 @@
 #ifndef __DEFRAG__
 #define __DEFRAG__
 
+  #include <time.h>
+
+  extern unsigned long def_maxTime;
+  extern unsigned long long def_maxIO;
+  extern time_t def_startTime;
+  extern const char *def_resumeFile;
+
   int def_defragTable();
 
 #endif
@@ -29,7 +29,28 @@
   int d_mount(int);
   int d_umount();
   int d_mounted();
-  unsigned short d_readSectors(unsigned long, void*, unsigned short, unsigned short);
-  unsigned short d_writeSectors(unsigned long, void*, unsigned short, unsigned short);
+  int d_sync();
+  int d_datasync();
+  void *d_address(unsigned long, unsigned long, unsigned short);
+  extern int d_useMmap;
+  extern unsigned int d_queueDepth;
+  extern int d_useDirect;
+  extern unsigned long long d_transferred;
+  void *d_allocBuffer(size_t);
+
+  typedef struct d_Queue d_Queue;
+  d_Queue *d_openQueue();
+  void d_closeQueue(d_Queue *);
+  int d_queueAsync(d_Queue *);
+  int d_registerBuffer(d_Queue *, void *, size_t);
+  int d_queueSectors(d_Queue *, unsigned long, void *, unsigned long, unsigned short, int);
+  int d_waitQueue(d_Queue *);
+  #include <sys/uio.h>
+  int d_queueSectorsv(d_Queue *, unsigned long, const struct iovec *, int, unsigned short, int);
+
+  unsigned long d_readSectors(unsigned long, void*, unsigned long, unsigned short);
+  unsigned long d_writeSectors(unsigned long, void*, unsigned long, unsigned short);
+  unsigned long d_readSectorsv(unsigned long, const struct iovec*, int, unsigned short);
+  unsigned long d_writeSectorsv(unsigned long, const struct iovec*, int, unsigned short);
 
 #endif
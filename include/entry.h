@@ -34,7 +34,9 @@
     unsigned f_xmode	 : 1;
     unsigned f_analyze   : 1;
     unsigned f_force     : 1;
-    unsigned f_reserved  : 3;
+    unsigned f_sweep     : 1;
+    unsigned f_intent    : 1;
+    unsigned f_trace     : 1;
   } __attribute__((packed)) Oflags;
 
   /* error message print */
@@ -25,6 +25,7 @@
 
 #ifndef __FAT32__
 #define __FAT32__
+  #include <disk.h>
 
   #define FAT12 12
   #define FAT16 16
@@ -38,6 +39,10 @@
   #define F32_BAD(x)       ((x) == F32_BAD_L)
   #define F32_LAST(x)      (((x) >= 0xFFFFFF8L) && \
 			    ((x) <= 0xFFFFFFFL))
+  /* bitmaps of clusters (one bit per cluster, 0..clusterCount) */
+  #define F32_WORD_BITS      (8 * sizeof(unsigned long))
+  #define F32_BITMAP_WORDS   (info.clusterCount / F32_WORD_BITS + 1)
+
   #define F32_RESERVED(x)  (((x) >= 0xFFFFFF0L) && \
                             ((x) <= 0xFFFFFF6L))
 
@@ -105,6 +110,9 @@
   extern F32_BPB bpb;
   extern F32_Info info;
   extern char *FATbitfield;
+  extern unsigned long *FATtable;
+  extern unsigned long *FATfree;
+  extern unsigned long f32_dirtyLimit;
 
   int f32_mount(int);
   int f32_mounted();
@@ -114,7 +122,20 @@
   unsigned long f32_getNextCluster(unsigned long cluster);
   int f32_readCluster(unsigned long, void*);
   int f32_writeCluster(unsigned long, void*);
+  int f32_readClusters(unsigned long, unsigned long, void*);
+  int f32_writeClusters(unsigned long, unsigned long, void*);
+  int f32_readClustersv(unsigned long, unsigned long, void**);
+  int f32_writeClustersv(unsigned long, unsigned long, void**);
+  int f32_queueClusters(d_Queue*, unsigned long, unsigned long, void*, int);
+  int f32_queueClustersv(d_Queue*, unsigned long, unsigned long, void**, struct iovec*, int);
+  int f32_transferClustersv(unsigned long, unsigned long, void**, int);
   int f32_readFAT(unsigned long, unsigned long*);
   int f32_writeFAT(unsigned long, unsigned long);
+  int f32_flushFAT();
+  int f32_checkpoint();
+  int f32_checkpointDue();
+  unsigned long f32_getParent(unsigned long cluster);
+  void *f32_clusterAddress(unsigned long cluster);
+  unsigned long f32_nextBit(const unsigned long *bitmap, unsigned long begin);
 
 #endif
@@ -0,0 +1,32 @@
+/*
+ * intent.h
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __INTENT__
+#define __INTENT__
+
+  int in_open(const char *filename);
+  void in_start();
+  void in_close();
+  void in_protect(unsigned long LBA, unsigned long count, const void *data);
+  void in_protectCluster(unsigned long cluster, const void *data);
+  int in_sync();
+  int in_enabled();
+  int in_batchFull();
+  int in_commit();
+
+#endif
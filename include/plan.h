@@ -0,0 +1,53 @@
+/*
+ * plan.h
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ * 
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ * 
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __PLAN__
+#define __PLAN__
+  #include <stdio.h>
+
+  /* Placement policy; it gives the order in which items of aTable are placed one next to other */
+  typedef struct {
+    const char *name;			/* name of the policy (for the command line) */
+    void (*order)(unsigned long *order);	/* fills indexes of all items of aTable in the order of placement */
+  } pl_Policy;
+
+  extern unsigned long *planTarget;
+  extern unsigned long *planSource;
+  extern unsigned long planMoves;
+  extern const char *pl_dumpFile;
+  extern const pl_Policy *pl_policy;
+  extern int pl_selective;
+  extern unsigned long pl_minFragments;
+  extern float pl_minFragmentation;
+  extern unsigned long long pl_minSize;
+  extern unsigned long long pl_maxSize;
+  extern unsigned long pl_gap;
+  extern unsigned long pl_recentDays;
+  extern int pl_spread;
+  extern int pl_orderOnly;
+  extern const char *pl_traceFile;
+
+  int pl_plan();
+  void pl_free();
+  int pl_setPolicy(const char *name);
+  void pl_addUnder(const char *path);
+  unsigned long pl_nextChain(unsigned long *from, int *cycle);
+  void pl_print(FILE *stream);
+  int pl_dump(const char *filename);
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * space.h
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __SPACE__
+#define __SPACE__
+
+  extern unsigned long spExtentCount;
+  extern unsigned long spFreeClusters;
+
+  void sp_build();
+  void sp_free();
+  void sp_allocate(unsigned long start, unsigned long length);
+  void sp_release(unsigned long start, unsigned long length);
+  unsigned long sp_firstFit(unsigned long length, unsigned long from);
+  unsigned long sp_bestFit(unsigned long length);
+  unsigned long sp_largest(unsigned long *length);
+
+#endif
@@ -0,0 +1,368 @@
+/**
+ * @file intent.c
+ *
+ * @brief Module keeps the intent log of the defragmentation
+ *
+ * The defragmentation writes the FAT (and BPB) only at checkpoints; the data and directories moved between two
+ * checkpoints (one batch) are written in the meantime, so if the program is interrupted, the FAT on the disk refers to
+ * clusters that were already overwritten. The intent log is a file (given by -i option) where the original contents of
+ * sectors are saved before they are overwritten for the first time in the batch (in_protect). The log is synchronized
+ * once before each group of writes (in_sync), e.g. once per ride of the "school bus". Clusters that were free at the
+ * last checkpoint are not saved, nobody refers to them.
+ *
+ * At the checkpoint, the image is synchronized and the log is emptied (in_commit). If the program finds non-empty log
+ * at the next run (in_open), the last incomplete batch is rolled back - the saved sectors are written back, so the
+ * disk image gets the state of the last checkpoint.
+ *
+ * Format of the log: in_Header, followed by records (in_Record and the saved sectors). A record that is not complete
+ * or its checksum is wrong (the program was interrupted while the log was written) is ignored, because the sectors of
+ * such a record were not overwritten yet.
+ */
+
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <libintl.h>
+#include <locale.h>
+
+#include <entry.h>
+#include <disk.h>
+#include <fat32.h>
+#include <intent.h>
+
+/** identification of the log file */
+#define IN_MAGIC "F32INTNT"
+/** identification of a record */
+#define IN_RECORD_MAGIC 0x52544e49
+/** size of the log (in bytes) when a checkpoint should be done, so the log does not grow without limit */
+#define IN_BATCH_LIMIT (64UL << 20)
+
+/** Header of the log file */
+typedef struct {
+  char magic[8];          /* IN_MAGIC */
+  uint32_t BPSector;      /* bytes per sector of the image */
+  unsigned char volID[4]; /* serial number of the volume (BS_VolID) */
+} __attribute__((packed)) in_Header;
+
+/** Record of the log; it is followed by the saved sectors */
+typedef struct {
+  uint32_t magic;         /* IN_RECORD_MAGIC */
+  uint32_t count;         /* number of the saved sectors */
+  uint64_t LBA;           /* the first saved sector */
+  uint32_t sum;           /* checksum of the record and the sectors */
+} __attribute__((packed)) in_Record;
+
+/** descriptor of the log file (-1 if the log is not used) */
+static int inLog = -1;
+/** name of the log file */
+static char *inName = NULL;
+/** size of the log (in bytes) */
+static unsigned long long inSize = 0;
+/** records that were not written into the log file yet */
+static unsigned char *inPending = NULL;
+static unsigned long inPendingSize = 0, inPendingAlloc = 0;
+/** bitmap of sectors before the data area that were saved in the batch */
+static unsigned long *inSectors = NULL;
+/** bitmap of clusters that were saved in the batch */
+static unsigned long *inClusters = NULL;
+/** bitmap of clusters that were free at the last checkpoint (a copy of FATfree) */
+static unsigned long *inFree = NULL;
+/** lock of the log (the writer thread of the bus and the main thread use it) */
+static pthread_mutex_t inLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The function computes the checksum (FNV-1a) of the record and its sectors */
+static uint32_t in_checksum(in_Record *rec, const unsigned char *data, unsigned long size)
+{
+  uint32_t sum = 2166136261U;
+  unsigned long i;
+
+  for (i = 0; i < sizeof(uint32_t) * 2 + sizeof(uint64_t); i++)
+    sum = (sum ^ ((unsigned char *)rec)[i]) * 16777619U;
+  for (i = 0; i < size; i++)
+    sum = (sum ^ data[i]) * 16777619U;
+  return sum;
+}
+
+/** The function tests and sets a bit in the bitmap
+ *  @return the original value of the bit
+ */
+static int in_testAndSet(unsigned long *bitmap, unsigned long bit)
+{
+  unsigned long mask = 1UL << (bit % F32_WORD_BITS);
+  int old = (bitmap[bit / F32_WORD_BITS] & mask) ? 1 : 0;
+
+  bitmap[bit / F32_WORD_BITS] |= mask;
+  return old;
+}
+
+/** The function starts new batch - no sectors are saved, and the current free clusters are remembered. */
+static void in_begin()
+{
+  memset(inSectors, 0, (info.firstDataSector / F32_WORD_BITS + 1) * sizeof(unsigned long));
+  memset(inClusters, 0, F32_BITMAP_WORDS * sizeof(unsigned long));
+  memcpy(inFree, FATfree, F32_BITMAP_WORDS * sizeof(unsigned long));
+}
+
+/** The function truncates the log to the header and synchronizes it.
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+static int in_truncate()
+{
+  inSize = sizeof(in_Header);
+  inPendingSize = 0;
+  return (ftruncate(inLog, inSize) || fdatasync(inLog)) ? 1 : 0;
+}
+
+/** The function rolls back the incomplete batch found in the log - all the saved sectors are written back (in the
+ *  reverse order).
+ *  @return number of the restored records
+ */
+static unsigned long in_rollback()
+{
+  in_Header header;
+  in_Record rec;
+  unsigned long long *offsets = NULL, pos = sizeof(in_Header), end = lseek(inLog, 0, SEEK_END);
+  unsigned long count = 0, size = 0, i;
+  unsigned char *data = NULL;
+
+  if (pread(inLog, &header, sizeof(header), 0) != sizeof(header))
+    return 0;
+  if (memcmp(header.magic, IN_MAGIC, 8))
+    error(0,_("Wrong intent log: %s"), inName);
+  if ((header.BPSector != info.BPSector) || memcmp(header.volID, bpb.BS_VolID, 4))
+    error(0,_("The intent log (%s) does not belong to the image !"), inName);
+
+  /* 1. valid records are found */
+  while (pos + sizeof(rec) <= end) {
+    if ((pread(inLog, &rec, sizeof(rec), pos) != sizeof(rec)) || (rec.magic != IN_RECORD_MAGIC) ||
+        (pos + sizeof(rec) + (unsigned long long)rec.count * info.BPSector > end))
+      break;
+    if (rec.count * info.BPSector > size) {
+      free(data);
+      size = rec.count * info.BPSector;
+      data = (unsigned char *)d_allocBuffer(size);
+    }
+    if ((pread(inLog, data, rec.count * info.BPSector, pos + sizeof(rec)) != rec.count * info.BPSector) ||
+        (in_checksum(&rec, data, rec.count * info.BPSector) != rec.sum))
+      break;
+    if ((offsets = (unsigned long long *)realloc(offsets, (count + 1) * sizeof(unsigned long long))) == NULL)
+      error(0,_("Out of memory !"));
+    offsets[count++] = pos;
+    pos += sizeof(rec) + rec.count * info.BPSector;
+  }
+
+  /* 2. the sectors are written back (the records were checked already, so a failed read is an I/O error) */
+  for (i = count; i > 0; i--) {
+    if ((pread(inLog, &rec, sizeof(rec), offsets[i-1]) != sizeof(rec)) ||
+        (pread(inLog, data, rec.count * info.BPSector, offsets[i-1] + sizeof(rec)) != rec.count * info.BPSector))
+      error(0,_("Can't read intent log (%s) !"), inName);
+    if (debug_mode)
+      fprintf(output_stream, "(in_rollback) restoring 0x%llx (%u sectors)\n", (unsigned long long)rec.LBA, rec.count);
+    if (d_writeSectors(rec.LBA, data, rec.count, info.BPSector) != rec.count)
+      error(0,_("Can't write to image (pos.:0x%lx) !"), (unsigned long)rec.LBA);
+  }
+  if (count && d_datasync())
+    error(0,_("Can't write to image !"));
+  free(offsets);
+  free(data);
+  return count;
+}
+
+/** The function opens (or creates) the intent log; the file system has to be mounted. If the log contains an
+ *  incomplete batch, it is rolled back - then the file system has to be mounted again, because the FAT was changed.
+ *  @param filename name of the log file
+ *  @return 1 if the batch was rolled back, 0 otherwise
+ */
+int in_open(const char *filename)
+{
+  in_Header header;
+  unsigned long restored;
+
+  inName = strdup(filename);
+  if ((inLog = open(filename, O_RDWR | O_CREAT, 0600)) == -1)
+    error(0,_("Can't open intent log (%s)"), filename);
+  if ((restored = in_rollback()))
+    fprintf(output_stream, _("Interrupted defragmentation was rolled back (%lu records).\n"), restored);
+
+  memcpy(header.magic, IN_MAGIC, 8);
+  header.BPSector = info.BPSector;
+  memcpy(header.volID, bpb.BS_VolID, 4);
+  if ((pwrite(inLog, &header, sizeof(header), 0) != sizeof(header)) || in_truncate())
+    error(0,_("Can't write intent log !"));
+  return (restored) ? 1 : 0;
+}
+
+/** The function prepares the log for the defragmentation of the mounted file system (the bitmaps of saved sectors). */
+void in_start()
+{
+  if (inLog == -1) return;
+  if (((inSectors = (unsigned long *)malloc((info.firstDataSector / F32_WORD_BITS + 1) * sizeof(unsigned long))) == NULL) ||
+      ((inClusters = (unsigned long *)malloc(F32_BITMAP_WORDS * sizeof(unsigned long))) == NULL) ||
+      ((inFree = (unsigned long *)malloc(F32_BITMAP_WORDS * sizeof(unsigned long))) == NULL))
+    error(0,_("Out of memory !"));
+  in_begin();
+}
+
+/** The function closes the log; it has to be empty (the last batch is committed), so the file is removed. */
+void in_close()
+{
+  if (inLog == -1) return;
+  close(inLog);
+  unlink(inName);
+  inLog = -1;
+  free(inName);
+  free(inPending);
+  free(inSectors);
+  free(inClusters);
+  free(inFree);
+  inName = NULL;
+  inPending = NULL;
+  inSectors = inClusters = inFree = NULL;
+  inPendingSize = inPendingAlloc = 0;
+}
+
+/** The function appends a record with the sectors into the pending part of the log.
+ *  @param LBA the first sector
+ *  @param count number of sectors
+ *  @param data original contents of the sectors (if NULL, they are read from the image)
+ */
+static void in_append(unsigned long LBA, unsigned long count, const void *data)
+{
+  in_Record rec;
+  unsigned long size = count * info.BPSector;
+  unsigned char *dest;
+
+  if (inPendingSize + sizeof(rec) + size > inPendingAlloc) {
+    inPendingAlloc = (inPendingSize + sizeof(rec) + size) * 2;
+    if ((inPending = (unsigned char *)realloc(inPending, inPendingAlloc)) == NULL)
+      error(0,_("Out of memory !"));
+  }
+  dest = inPending + inPendingSize + sizeof(rec);
+  if (data)
+    memcpy(dest, data, size);
+  else if (d_readSectors(LBA, dest, count, info.BPSector) != count)
+    error(0,_("Can't read from image (pos.:0x%lx)!"), LBA);
+  rec.magic = IN_RECORD_MAGIC;
+  rec.count = count;
+  rec.LBA = LBA;
+  rec.sum = in_checksum(&rec, dest, size);
+  memcpy(inPending + inPendingSize, &rec, sizeof(rec));
+  inPendingSize += sizeof(rec) + size;
+}
+
+/** The function saves original contents of sectors that are going to be overwritten, if they were not saved in the
+ *  batch yet. Sectors of the data area are saved by whole clusters, and only if the cluster was used at the last
+ *  checkpoint. The sectors must not be overwritten before in_sync is called.
+ *  @param LBA the first sector
+ *  @param count number of sectors
+ *  @param data original contents of the sectors, or NULL if they should be read from the image
+ */
+void in_protect(unsigned long LBA, unsigned long count, const void *data)
+{
+  unsigned long sector, cluster, last;
+
+  if ((inLog == -1) || !inClusters || !count) return;
+  pthread_mutex_lock(&inLock);
+  for (sector = LBA; (sector < LBA + count) && (sector < info.firstDataSector); sector++)
+    if (!in_testAndSet(inSectors, sector))
+      in_append(sector, 1, (data) ? (const unsigned char *)data + (sector - LBA) * info.BPSector : NULL);
+  if (LBA + count > info.firstDataSector) {
+    cluster = (sector - info.firstDataSector) / bpb.BPB_SecPerClus + 2;
+    last = (LBA + count - 1 - info.firstDataSector) / bpb.BPB_SecPerClus + 2;
+    for (; cluster <= last; cluster++) {
+      if (in_testAndSet(inClusters, cluster) || (inFree[cluster / F32_WORD_BITS] & (1UL << (cluster % F32_WORD_BITS))))
+        continue;
+      sector = info.firstDataSector + (cluster - 2) * bpb.BPB_SecPerClus;
+      /* the given data can be used only if they cover whole cluster */
+      in_append(sector, bpb.BPB_SecPerClus, (data && (sector >= LBA) && (sector + bpb.BPB_SecPerClus <= LBA + count))
+                ? (const unsigned char *)data + (sector - LBA) * info.BPSector : NULL);
+    }
+  }
+  pthread_mutex_unlock(&inLock);
+}
+
+/** The function saves original contents of a cluster that is going to be overwritten (see in_protect).
+ *  @param cluster number of the cluster
+ *  @param data original contents of the cluster, or NULL if they should be read from the image
+ */
+void in_protectCluster(unsigned long cluster, const void *data)
+{
+  in_protect(info.firstDataSector + (cluster - 2) * bpb.BPB_SecPerClus, bpb.BPB_SecPerClus, data);
+}
+
+/** The function writes the pending records into the log and synchronizes it; after that the saved sectors can be
+ *  overwritten.
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int in_sync()
+{
+  unsigned long done = 0;
+  ssize_t n;
+  int ret = 0;
+
+  if (inLog == -1) return 0;
+  pthread_mutex_lock(&inLock);
+  if (inPendingSize) {
+    while (done < inPendingSize) {
+      if ((n = pwrite(inLog, inPending + done, inPendingSize - done, inSize + done)) <= 0) break;
+      done += n;
+    }
+    if ((done < inPendingSize) || fdatasync(inLog))
+      ret = 1;
+    inSize += done;
+    inPendingSize = 0;
+  }
+  pthread_mutex_unlock(&inLock);
+  return ret;
+}
+
+/** The function determines if the intent log is used.
+ *  @return 1 if the log is open, 0 otherwise
+ */
+int in_enabled()
+{
+  return (inLog != -1) ? 1 : 0;
+}
+
+/** The function determines if the log is so large that a checkpoint should be done.
+ *  @return 1 if the checkpoint should be done, 0 otherwise
+ */
+int in_batchFull()
+{
+  return ((inLog != -1) && (inSize + inPendingSize >= IN_BATCH_LIMIT)) ? 1 : 0;
+}
+
+/** The function commits the batch at a checkpoint (all the data, directories and FAT have to be written). The image is
+ *  synchronized, the log is emptied and new batch begins.
+ *  @return In a case of error, it returns 1; 0 otherwise.
+ */
+int in_commit()
+{
+  if ((inLog == -1) || !inClusters) return 0;
+  if (d_datasync() || in_truncate())
+    return 1;
+  if (debug_mode)
+    fprintf(output_stream, "  (in_commit) batch committed\n");
+  in_begin();
+  return 0;
+}
@@ -0,0 +1,893 @@
+/**
+ * @file plan.c
+ *
+ * @brief Module computes the plan of defragmentation before any data is moved
+ *
+ * The plan is computed from the aTable contents and the in-memory FAT. Files and directories are placed one next
+ * to other in the order given by the placement policy (pl_policy), starting from the first cluster of the data area. Bad clusters and used clusters
+ * that don't belong to any item of aTable (lost chains) are obstacles - they stay where they are and the placement
+ * skips them.
+ *
+ * The result is a mapping of clusters (planTarget - where the data of the cluster will be moved, and its inversion
+ * planSource). The mapping is decomposed into chains of moves - paths and cycles:
+ *
+ * - path: x0 -> x1 -> ... -> xn, where the data of x0 move to x1, data of x1 to x2 and so on. The last cluster xn is
+ *   free, so the chain can be applied from its end and every cluster is moved exactly once.
+ * - cycle: c0 -> c1 -> ... -> c0; all the clusters are used, the data of one of them have to be held aside.
+ *
+ * The chains can be printed or dumped into a file, so the cost of defragmentation can be estimated in advance.
+ *
+ * Placement policies:
+ *
+ * - table - the order of aTable (items of a directory precede the directory itself),
+ * - dirs - directory locality; the clusters of each directory precede the items it contains, the items are in
+ *   the order of directory entries and subdirectories are placed recursively (as find or cp -r traverse them).
+ *
+ * Gaps (pl_gap, pl_spread): free clusters are left after each directory and after each recently modified file (by
+ * the date of the last modification in its directory entry), so the items can grow and stay continuous. The size of
+ * the gaps is limited by the free space; with pl_spread all the free space is spread among them evenly.
+ *
+ * Access trace (pl_traceFile): files (or ranges of files) that are read at once, e.g. when the system boots, are
+ * placed first in the order of the trace, from the first cluster of the data area. The other items follow by the
+ * placement policy. Each line of the trace is a path within the volume, optionally followed by offset and length
+ * (in bytes) of the range that is read; fields are separated by tabulators. A line without offset means the whole
+ * file, an offset without length means a range of one byte (so only the cluster that holds the offset is placed).
+ * Empty lines and lines that start with '#' are ignored.
+ *
+ * In order-only mode (pl_orderOnly) the items are not compacted. Only the items that have a backward link in their
+ * chain are changed: their clusters are put in ascending order within the same set of clusters, so a file is read
+ * by forward seeks only. The moves of such plan are cycles inside the items.
+ *
+ * In selective mode (pl_selective) only the items that benefit are moved: fragmented items that pass the thresholds
+ * (number of fragments, percentual fragmentation, size, directories). Contiguous items are skipped at once by their
+ * number of extents and together with other not selected items they are obstacles. Each selected item is moved
+ * into the first free extent where it fits as a whole (the free extents are found by the space index).
+ */
+
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libintl.h>
+#include <locale.h>
+#include <strings.h>
+
+#include <entry.h>
+#include <fat32.h>
+#include <analyze.h>
+#include <space.h>
+#include <plan.h>
+
+/* states of clusters in planMark */
+#define PL_NONE   0	/* cluster doesn't belong to any item of aTable */
+#define PL_OWNED  1	/* cluster belongs to an item of aTable */
+#define PL_PLACED 2	/* target of the cluster is already computed */
+#define PL_DONE   3	/* chain of moves with this cluster was already given out */
+#define PL_GAP    4	/* free cluster that is left as a gap (selective mode) */
+
+/** planTarget[x] holds new position of the data of cluster x; 0 if the data stay */
+unsigned long *planTarget = NULL;
+/** planSource[x] holds the cluster which data will be moved into cluster x; 0 if there are no such data */
+unsigned long *planSource = NULL;
+/** states of the clusters (PL_ constants) */
+unsigned char *planMark = NULL;
+/** bitmap of clusters usable as targets (free clusters and clusters of items); it is used only by the placement */
+static unsigned long *planUsable = NULL;
+/** lists of children of directories in the order of directory entries; childHead[d] is the first child of the item d
+    and childNext[i] the next one after the item i (indexes are shifted by 1, 0 is the end of a list) */
+static unsigned long *childHead = NULL, *childNext = NULL;
+
+/** number of clusters that will be moved */
+unsigned long planMoves = 0;
+
+/** name of the file into which the plan is dumped when it is computed (NULL if it should not be dumped) */
+const char *pl_dumpFile = NULL;
+
+static void pl_orderTable(unsigned long *order);
+static void pl_orderDirs(unsigned long *order);
+
+/** Built-in placement policies; the list is terminated by an empty policy */
+static const pl_Policy pl_policies[] = {
+  { "table", pl_orderTable },
+  { "dirs",  pl_orderDirs },
+  { NULL,    NULL }
+};
+
+/** placement policy that gives the order of items in the plan */
+const pl_Policy *pl_policy = &pl_policies[0];
+
+/** whether only selected items are moved (selective mode) */
+int pl_selective = 0;
+/** minimal number of fragments (extents) of a selected item */
+unsigned long pl_minFragments = 0;
+/** minimal percentual fragmentation of a selected item */
+float pl_minFragmentation = 0.0;
+/** minimal size (in bytes) of a selected item */
+unsigned long long pl_minSize = 0;
+/** maximal size (in bytes) of a selected item (0 means unlimited) */
+unsigned long long pl_maxSize = 0;
+/** paths of directories; only items within them are selected (if there are any) */
+const char **pl_under = NULL;
+/** number of the paths in pl_under */
+unsigned int pl_underCount = 0;
+
+/** number of free clusters left after each directory and each recently modified file (0 means no gaps) */
+unsigned long pl_gap = 0;
+/** a file is recently modified if it was modified at most so many days before the newest file of the volume */
+unsigned long pl_recentDays = 30;
+/** whether all the free space is spread among the gaps */
+int pl_spread = 0;
+
+/** number of gaps left by the plan */
+unsigned long planGaps = 0;
+/** number of clusters in the gaps (some of them will be free after the moves) */
+unsigned long planSlack = 0;
+
+/** name of the file with access trace (NULL if it is not used) */
+const char *pl_traceFile = NULL;
+
+/** number of items of the access trace that were placed first */
+unsigned long planTraced = 0;
+/** number of clusters of the access trace that were placed first */
+unsigned long planTraceClusters = 0;
+/** number of lines of the access trace that were skipped (the item was not found, it is empty or it has cross
+    referrences) */
+unsigned long planTraceMissing = 0;
+
+/** whether the clusters of items are only ordered (not compacted) */
+int pl_orderOnly = 0;
+
+/** number of items reordered in order-only mode */
+unsigned long planReordered = 0;
+
+/** number of items selected in selective mode */
+unsigned long planSelected = 0;
+/** number of selected items that were not placed, because there is no free extent large enough */
+unsigned long planSkipped = 0;
+
+/** The function finds first cluster that can be used as a target (it is free, or it belongs to some item of aTable
+  * and so it will be moved away). Bad clusters and clusters of lost chains are not usable. The bitmap of usable
+  * clusters is searched by words.
+  * @param beginCluster from where we should start to search
+  * @return found cluster or 0 if there is none
+  */
+unsigned long pl_findFirstUsable(unsigned long beginCluster)
+{
+  return f32_nextBit(planUsable, beginCluster);
+}
+
+/** The function sets the placement policy.
+ *  @param name name of the policy
+ *  @return It returns 0 if there was no error, 1 if there is no such policy.
+ */
+int pl_setPolicy(const char *name)
+{
+  const pl_Policy *policy;
+
+  for (policy = pl_policies; policy->name; policy++)
+    if (!strcmp(policy->name, name)) {
+      pl_policy = policy;
+      return 0;
+    }
+  return 1;
+}
+
+/** Policy "table": the items are placed in the order of aTable.
+ *  @param order[output] indexes of all items of aTable in the order of placement
+ */
+static void pl_orderTable(unsigned long *order)
+{
+  unsigned long i;
+
+  for (i = 0; i < tableCount; i++)
+    order[i] = i;
+}
+
+/** The function links items of aTable into lists of children of their directories (if they are not linked yet).
+ *  Items of a directory follow in aTable in the order of directory entries, so the lists keep that order.
+ */
+static void pl_linkChildren()
+{
+  unsigned long *childTail, i;
+
+  if (childHead) return;
+  if (((childHead = (unsigned long *)calloc(tableCount, sizeof(unsigned long))) == NULL) ||
+      ((childNext = (unsigned long *)calloc(tableCount, sizeof(unsigned long))) == NULL) ||
+      ((childTail = (unsigned long *)calloc(tableCount, sizeof(unsigned long))) == NULL))
+    error(0,_("Out of memory !"));
+  for (i = 1; i < tableCount; i++) {
+    if (aParent[i] == i) continue;
+    if (childTail[aParent[i]])
+      childNext[childTail[aParent[i]] - 1] = i + 1;
+    else
+      childHead[aParent[i]] = i + 1;
+    childTail[aParent[i]] = i + 1;
+  }
+  free(childTail);
+}
+
+/** Policy "dirs": each directory is placed just before the items it contains. The tree is walked in pre-order by
+ *  a stack of directories, the items of a directory are taken from the list of its children. Items that were not
+ *  reached from the root (they should not exist) are placed at the end in the order of aTable.
+ *  @param order[output] indexes of all items of aTable in the order of placement
+ */
+static void pl_orderDirs(unsigned long *order)
+{
+  unsigned long *stack;
+  unsigned long i, item, count = 0, depth = 0;
+  unsigned char *placed;
+
+  if (((stack = (unsigned long *)malloc(tableCount * sizeof(unsigned long))) == NULL) ||
+      ((placed = (unsigned char *)calloc(tableCount, sizeof(unsigned char))) == NULL))
+    error(0,_("Out of memory !"));
+  pl_linkChildren();
+
+  /* the stack holds the next child of each directory that is being placed */
+  placed[0] = 1;
+  order[count++] = 0;
+  stack[depth++] = childHead[0];
+  while (depth) {
+    if (!(item = stack[depth - 1])) {
+      depth--;
+      continue;
+    }
+    stack[depth - 1] = childNext[item - 1];
+    if (placed[item - 1]) continue;
+    placed[item - 1] = 1;
+    order[count++] = item - 1;
+    if (aTable[item - 1].isDir && childHead[item - 1])
+      stack[depth++] = childHead[item - 1];
+  }
+  for (i = 0; i < tableCount; i++)
+    if (!placed[i]) order[count++] = i;
+
+  free(placed);
+  free(stack);
+}
+
+/** The function adds a directory into the selection; only items within the given directories are selected.
+ *  @param path path of the directory within the volume (e.g. /DOCS/2006)
+ */
+void pl_addUnder(const char *path)
+{
+  if ((pl_under = (const char **)realloc(pl_under, (pl_underCount + 1) * sizeof(const char *))) == NULL)
+    error(0,_("Out of memory !"));
+  pl_under[pl_underCount++] = path;
+  pl_selective = 1;
+}
+
+/** The function finds an item of the directory by its name. Both short (8.3) and long names are compared (without
+ *  regard to case; only ASCII characters of long names are taken). The clusters of the directory are read from disk.
+ *  @param dir index of the directory in aTable
+ *  @param name name of the item
+ *  @return index of the item in aTable, or tableCount if there is no such item
+ */
+static unsigned long pl_findChild(unsigned long dir, const char *name)
+{
+  static const unsigned char slotOffsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+  unsigned long entryCount = (bpb.BPB_SecPerClus * info.BPSector) / sizeof(F32_DirEntry);
+  unsigned long cluster, count, index = 0, base, i, k;
+  unsigned short c;
+  unsigned char *raw;
+  F32_DirEntry *entries;
+  char longName[261], shortName[13];
+  int found = 0;
+
+  entries = (F32_DirEntry *)d_allocBuffer(entryCount * sizeof(F32_DirEntry));
+  longName[0] = 0;
+  for (cluster = aStartCluster[dir], count = 0; (cluster >= 2) && (cluster <= info.clusterCount) &&
+       (count < info.clusterCount); cluster = f32_getNextCluster(cluster), count++) {
+    if (f32_readCluster(cluster, entries))
+      error(0,_("Can't read cluster 0x%lx !"), cluster);
+    for (index = 0; index < entryCount; index++) {
+      raw = (unsigned char *)&entries[index];
+      if (!raw[0]) break;
+      if (raw[0] == 0xe5) {
+        longName[0] = 0;
+        continue;
+      }
+      /* slots of a long name precede the entry (the last one first), each of them holds 13 UCS-2 characters */
+      if (entries[index].attributes == 0x0f) {
+        if (!(raw[0] & 0x1f)) continue;
+        base = ((raw[0] & 0x1f) - 1) * 13;
+        for (k = 0; (k < 13) && (base + k < sizeof(longName) - 1); k++) {
+          c = raw[slotOffsets[k]] | (raw[slotOffsets[k] + 1] << 8);
+          longName[base + k] = (!c || (c == 0xffff)) ? 0 : (c < 0x80) ? c : '?';
+        }
+        if ((raw[0] & 0x40) && (base + 13 < sizeof(longName)))
+          longName[base + 13] = 0;
+        continue;
+      }
+      for (i = 0, k = 0; (k < 8) && (entries[index].fileName[k] != ' '); k++)
+        shortName[i++] = entries[index].fileName[k];
+      if (entries[index].fileExt[0] != ' ') {
+        shortName[i++] = '.';
+        for (k = 0; (k < 3) && (entries[index].fileExt[k] != ' '); k++)
+          shortName[i++] = entries[index].fileExt[k];
+      }
+      shortName[i] = 0;
+      if (!strcasecmp(shortName, name) || (longName[0] && !strcasecmp(longName, name))) {
+        found = 1;
+        break;
+      }
+      longName[0] = 0;
+    }
+    /* the end of the directory, or the item was found */
+    if (index < entryCount) break;
+  }
+  free(entries);
+  if (found)
+    for (pl_linkChildren(), i = childHead[dir]; i; i = childNext[i - 1])
+      if ((aTable[i - 1].entryCluster == cluster) && (aTable[i - 1].entryIndex == index))
+        return i - 1;
+  return tableCount;
+}
+
+/** The function finds an item by its path within the volume.
+ *  @param path the path; components are separated by '/'
+ *  @return index of the item in aTable, or tableCount if there is no such item
+ */
+static unsigned long pl_findItem(const char *path)
+{
+  unsigned long item = 0;
+  const char *begin, *end;
+  char name[261];
+
+  for (begin = path; *begin; begin = end) {
+    while (*begin == '/') begin++;
+    if (!*begin) break;
+    for (end = begin; *end && (*end != '/'); end++)
+      ;
+    if (((size_t)(end - begin) >= sizeof(name)) || !aTable[item].isDir)
+      return tableCount;
+    memcpy(name, begin, end - begin);
+    name[end - begin] = 0;
+    if ((item = pl_findChild(item, name)) == tableCount)
+      return tableCount;
+  }
+  return item;
+}
+
+/** The function finds a directory by its path within the volume.
+ *  @param path the path; components are separated by '/'
+ *  @return index of the directory in aTable
+ */
+static unsigned long pl_findDir(const char *path)
+{
+  unsigned long dir;
+
+  if ((dir = pl_findItem(path)) == tableCount)
+    error(0,_("Directory not found: %s"), path);
+  if (!aTable[dir].isDir)
+    error(0,_("Not a directory: %s"), path);
+  return dir;
+}
+
+/** The function selects items that will be moved in selective mode. Contiguous items (with a single extent) are
+ *  never selected; the other ones have to pass all the thresholds. Items within the directories of pl_under are found
+ *  by aParent: a parent follows its items in aTable (only the root is the first), so the table is walked backwards.
+ *  @return array of flags (one for each item of aTable); 1 if the item is selected
+ */
+static unsigned char *pl_select()
+{
+  unsigned long i, clusterSize = bpb.BPB_SecPerClus * info.BPSector;
+  unsigned long long size;
+  unsigned char *selected, *under = NULL;
+  unsigned int k;
+
+  if ((selected = (unsigned char *)calloc(tableCount, sizeof(unsigned char))) == NULL)
+    error(0,_("Out of memory !"));
+  if (pl_underCount) {
+    if ((under = (unsigned char *)calloc(tableCount, sizeof(unsigned char))) == NULL)
+      error(0,_("Out of memory !"));
+    for (k = 0; k < pl_underCount; k++)
+      under[pl_findDir(pl_under[k])] = 1;
+    for (i = tableCount - 1; i > 0; i--)
+      if (under[aParent[i]]) under[i] = 1;
+  }
+
+  planSelected = 0;
+  for (i = 0; i < tableCount; i++) {
+    if ((aTable[i].extentCount < 2) || (aTable[i].extentCount < pl_minFragments)) continue;
+    if ((float)(aTable[i].extentCount - 1) / (float)aClusterCount[i] * 100.0 < pl_minFragmentation) continue;
+    size = (unsigned long long)aClusterCount[i] * clusterSize;
+    if ((size < pl_minSize) || (pl_maxSize && (size > pl_maxSize))) continue;
+    if (under && !under[i]) continue;
+    selected[i] = 1;
+    planSelected++;
+  }
+  free(under);
+  return selected;
+}
+
+/** The function places the cluster to the first usable cluster at 'next' or after it.
+ *  @param cluster the cluster (it is owned by an item)
+ *  @param next[input/output] from where the target is searched; it is moved behind the target
+ */
+static void pl_placeCluster(unsigned long cluster, unsigned long *next)
+{
+  unsigned long target;
+
+  if (!(target = pl_findFirstUsable(*next)))
+    error(0,_("Not enough usable clusters for the plan !"));
+  planMark[cluster] = PL_PLACED;
+  if (target != cluster) {
+    planTarget[cluster] = target;
+    planSource[target] = cluster;
+    planMoves++;
+  }
+  *next = target + 1;
+}
+
+/** The function places items (or their ranges) of the access trace in the order of the trace. Clusters that were
+ *  placed already (the ranges overlap) are skipped. Only items with all their clusters marked are placed.
+ *  @param whole flags of items whose all clusters were marked by them
+ *  @param next[input/output] from where the clusters are placed; it is moved behind the last placed one
+ *  @return array of flags (one for each item of aTable); 1 if the item (or its part) was placed by the trace
+ */
+static unsigned char *pl_placeTrace(const unsigned char *whole, unsigned long *next)
+{
+  unsigned long clusterSize = bpb.BPB_SecPerClus * info.BPSector;
+  unsigned long item, e, cluster, index, first, last;
+  unsigned long long offset, length;
+  unsigned char *traced;
+  char line[4096], *field, *end;
+  FILE *f;
+
+  if ((traced = (unsigned char *)calloc(tableCount, sizeof(unsigned char))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((f = fopen(pl_traceFile, "r")) == NULL)
+    error(0,_("Can't open trace file: %s"), pl_traceFile);
+
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (!line[0] || (line[0] == '#')) continue;
+    offset = 0;
+    length = ~0ULL;
+    if ((field = strchr(line, '\t'))) {
+      *field++ = 0;
+      offset = strtoull(field, &end, 10);
+      length = 1;
+      if (*end == '\t')
+        length = strtoull(end + 1, &end, 10);
+      if (*end || !length) {
+        /* the whole line is reported, with the wrong offset or length */
+        field[-1] = '\t';
+        error(0,_("Wrong line of trace file: %s"), line);
+      }
+    }
+    if (((item = pl_findItem(line)) == tableCount) || !whole[item]) {
+      planTraceMissing++;
+      if (debug_mode)
+        fprintf(output_stream, "(pl_placeTrace) %s was skipped\n", line);
+      continue;
+    }
+    /* the range of clusters in the chain of the item */
+    if ((first = offset / clusterSize) >= aClusterCount[item]) continue;
+    last = (length > (unsigned long long)aClusterCount[item] * clusterSize - offset) ? aClusterCount[item] - 1 :
+           (offset + length - 1) / clusterSize;
+    if (!traced[item]) {
+      traced[item] = 1;
+      planTraced++;
+    }
+
+    for (e = aTable[item].extentIndex, index = 0; index <= last; e++)
+      for (cluster = anExtents[e].start; (cluster < anExtents[e].start + anExtents[e].length) && (index <= last);
+           cluster++, index++)
+        if ((index >= first) && (planMark[cluster] == PL_OWNED)) {
+          pl_placeCluster(cluster, next);
+          planTraceClusters++;
+        }
+  }
+  fclose(f);
+  return traced;
+}
+
+/** The function converts date of the last modification (in FAT format) into number of days (from 1.3. of year 0).
+ *  The years are counted from March, so the leap day is at the end of the year.
+ *  @param modified date (high word) and time of the modification
+ *  @return number of days
+ */
+static long pl_days(unsigned long modified)
+{
+  long year = 1980 + ((modified >> 25) & 0x7f), month = (modified >> 21) & 0x0f, day = (modified >> 16) & 0x1f;
+
+  if (month < 3) {
+    year--;
+    month += 12;
+  }
+  return 365 * year + year / 4 - year / 100 + year / 400 + (153 * (month - 3) + 2) / 5 + day;
+}
+
+/** The function finds the items that get a gap behind them: directories and files that were modified at most
+ *  pl_recentDays before the newest modified file of the volume.
+ *  @param count[output] number of such items
+ *  @return array of flags (one for each item of aTable); 1 if the item gets a gap
+ */
+static unsigned char *pl_growing(unsigned long *count)
+{
+  unsigned char *growing;
+  unsigned long i;
+  long newest = 0, days;
+
+  if ((growing = (unsigned char *)calloc(tableCount, sizeof(unsigned char))) == NULL)
+    error(0,_("Out of memory !"));
+  for (i = 1; i < tableCount; i++)
+    if (!aTable[i].isDir && ((days = pl_days(aTable[i].modified)) > newest))
+      newest = days;
+  for (i = 0, *count = 0; i < tableCount; i++)
+    if (aTable[i].isDir || (newest - pl_days(aTable[i].modified) <= (long)pl_recentDays)) {
+      growing[i] = 1;
+      (*count)++;
+    }
+  return growing;
+}
+
+/** The function skips usable clusters, they are left as a gap.
+ *  @param next from where the clusters are skipped
+ *  @param count number of clusters to skip
+ *  @return the cluster behind the gap
+ */
+static unsigned long pl_skipUsable(unsigned long next, unsigned long count)
+{
+  unsigned long cluster;
+
+  for (; count; count--, next = cluster + 1)
+    if (!(cluster = pl_findFirstUsable(next)))
+      break;
+  return next;
+}
+
+/** The function places a selected item into the first free extent where it fits as a whole. If the item should get
+ *  a gap, an extent with room for the gap is preferred. The extent is allocated in the space index (it is released
+ *  when the placement is finished).
+ *  @param item index of the item in aTable
+ *  @param gap number of free clusters that should be left behind the item
+ */
+static void pl_placeFree(unsigned long item, unsigned long gap)
+{
+  unsigned long e, cluster, target;
+
+  if (gap && (target = sp_firstFit(aClusterCount[item] + gap, 2))) {
+    sp_allocate(target + aClusterCount[item], gap);
+    memset(planMark + target + aClusterCount[item], PL_GAP, gap);
+    planGaps++;
+    planSlack += gap;
+  } else if (!(target = sp_firstFit(aClusterCount[item], 2))) {
+    planSkipped++;
+    return;
+  }
+  sp_allocate(target, aClusterCount[item]);
+  for (e = aTable[item].extentIndex; e < aTable[item].extentIndex + aTable[item].extentCount; e++)
+    for (cluster = anExtents[e].start; cluster < anExtents[e].start + anExtents[e].length; cluster++, target++) {
+      planMark[cluster] = PL_PLACED;
+      planTarget[cluster] = target;
+      planSource[target] = cluster;
+      planMoves++;
+    }
+}
+
+/** The function compares extents by their first clusters (for qsort) */
+static int pl_cmpExtent(const void *a, const void *b)
+{
+  unsigned long x = ((const anExtent *)a)->start, y = ((const anExtent *)b)->start;
+
+  return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/** The function puts clusters of an item into ascending order (order-only mode). The item keeps its clusters: the
+ *  n-th cluster of the chain is moved into the n-th lowest of them. An item without backward link is skipped by its
+ *  extents.
+ *  @param item index of the item in aTable
+ */
+static void pl_placeOrdered(unsigned long item)
+{
+  unsigned long first = aTable[item].extentIndex, count = aTable[item].extentCount;
+  unsigned long e, s = 0, cluster, target;
+  anExtent *sorted;
+
+  for (e = first + 1; e < first + count; e++)
+    if (anExtents[e].start < anExtents[e-1].start) break;
+  if (e >= first + count) return;
+
+  if ((sorted = (anExtent *)malloc(count * sizeof(anExtent))) == NULL)
+    error(0,_("Out of memory !"));
+  memcpy(sorted, anExtents + first, count * sizeof(anExtent));
+  qsort(sorted, count, sizeof(anExtent), pl_cmpExtent);
+  target = sorted[0].start;
+  for (e = first; e < first + count; e++)
+    for (cluster = anExtents[e].start; cluster < anExtents[e].start + anExtents[e].length; cluster++) {
+      planMark[cluster] = PL_PLACED;
+      if (target != cluster) {
+        planTarget[cluster] = target;
+        planSource[target] = cluster;
+        planMoves++;
+      }
+      if ((++target == sorted[s].start + sorted[s].length) && (++s < count))
+        target = sorted[s].start;
+    }
+  free(sorted);
+  planReordered++;
+}
+
+/** The function computes the plan of the defragmentation (planTarget and planSource mappings).
+ *  The items are not traversed by FAT, but by their extents found by the analysis; they are placed in the order given
+ *  by the placement policy.
+ *  At first all clusters of aTable items are marked, then the items are placed one next to other. Cross referrences
+ *  are ignored (the item is followed only up to the first already marked cluster). A contiguous item that is already
+ *  on its place is skipped at once. In selective mode only the selected items are marked and each of them is placed
+ *  into a free extent (items with cross referrences are not placed). In order-only mode the items are only reordered
+ *  within their own clusters. Otherwise the items of the access trace are placed before the others. If pl_dumpFile is
+ *  set, the plan is dumped into that file.
+ *  @return It returns 0 if there was no error.
+ */
+int pl_plan()
+{
+  unsigned long i, k, e, cluster, target, next = 2;
+  unsigned long *order, growingCount = 0, slack = 0, pending = 0, gap = pl_gap;
+  unsigned char *whole, *selected = NULL, *growing = NULL, *traced = NULL;
+
+  if ((planTarget = (unsigned long *)calloc(info.clusterCount + 1, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((planSource = (unsigned long *)calloc(info.clusterCount + 1, sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((planMark = (unsigned char *)calloc(info.clusterCount + 1, sizeof(unsigned char))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((planUsable = (unsigned long *)malloc(F32_BITMAP_WORDS * sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  /* whole[i] is 1 if all clusters of the item were marked by it (there is no cross referrence) */
+  if ((whole = (unsigned char *)calloc(tableCount, sizeof(unsigned char))) == NULL)
+    error(0,_("Out of memory !"));
+  if ((order = (unsigned long *)malloc(tableCount * sizeof(unsigned long))) == NULL)
+    error(0,_("Out of memory !"));
+  pl_policy->order(order);
+  memcpy(planUsable, FATfree, F32_BITMAP_WORDS * sizeof(unsigned long));
+  planMoves = planSkipped = planGaps = planSlack = planReordered = 0;
+  planTraced = planTraceClusters = planTraceMissing = 0;
+  if (pl_selective)
+    selected = pl_select();
+  if ((pl_gap || pl_spread) && !pl_orderOnly)
+    growing = pl_growing(&growingCount);
+
+  /* 1. marking of all clusters that belong to the items */
+  for (i = 0; i < tableCount; i++) {
+    if (selected && !selected[i]) continue;
+    for (e = aTable[i].extentIndex; e < aTable[i].extentIndex + aTable[i].extentCount; e++) {
+      for (cluster = anExtents[e].start; cluster < anExtents[e].start + anExtents[e].length; cluster++) {
+        if (planMark[cluster] != PL_NONE) break;
+        planMark[cluster] = PL_OWNED;
+        planUsable[cluster / F32_WORD_BITS] |= 1UL << (cluster % F32_WORD_BITS);
+      }
+      if (cluster < anExtents[e].start + anExtents[e].length) break;
+    }
+    whole[i] = (e == aTable[i].extentIndex + aTable[i].extentCount) ? 1 : 0;
+  }
+
+  /* the gaps are made from the clusters that are not needed by the items (free clusters and clusters of the items
+     are usable) */
+  if (growing && !selected) {
+    slack = spFreeClusters;
+    if (pl_spread && growingCount && (slack > pl_gap * growingCount))
+      gap += (slack - pl_gap * growingCount) / growingCount;
+  }
+
+  /* 2. placement; the access trace is placed first */
+  if (pl_traceFile && !selected && !pl_orderOnly)
+    traced = pl_placeTrace(whole, &next);
+  for (k = 0; k < tableCount; k++) {
+    i = order[k];
+    if (pl_orderOnly) {
+      if ((!selected || selected[i]) && whole[i])
+        pl_placeOrdered(i);
+      continue;
+    }
+    if (selected) {
+      if (selected[i] && whole[i])
+        pl_placeFree(i, (growing && growing[i]) ? gap : 0);
+      continue;
+    }
+    /* the gap behind the previous item */
+    if (pending) {
+      next = pl_skipUsable(next, pending);
+      pending = 0;
+    }
+    if (growing && growing[i] && slack && !(traced && traced[i])) {
+      pending = (gap < slack) ? gap : slack;
+      slack -= pending;
+      planGaps++;
+      planSlack += pending;
+    }
+    e = aTable[i].extentIndex;
+    if (whole[i] && (aTable[i].extentCount == 1) && !(traced && traced[i]) &&
+        (pl_findFirstUsable(next) == anExtents[e].start)) {
+      memset(planMark + anExtents[e].start, PL_PLACED, anExtents[e].length);
+      next = anExtents[e].start + anExtents[e].length;
+      continue;
+    }
+    for (; e < aTable[i].extentIndex + aTable[i].extentCount; e++) {
+      for (cluster = anExtents[e].start; cluster < anExtents[e].start + anExtents[e].length; cluster++) {
+        /* ranges of the access trace are placed already */
+        if (traced && traced[i] && (planMark[cluster] == PL_PLACED)) continue;
+        if (planMark[cluster] != PL_OWNED) break;
+        pl_placeCluster(cluster, &next);
+      }
+      if (cluster < anExtents[e].start + anExtents[e].length) break;
+    }
+  }
+
+  /* the free extents allocated by the placement (with the gaps) are given back to the space index */
+  if (selected && !pl_orderOnly)
+    for (cluster = 2; cluster <= info.clusterCount; cluster = target) {
+      for (target = cluster; (target <= info.clusterCount) && (planSource[target] || (planMark[target] == PL_GAP));
+           target++)
+        ;
+      if (target > cluster)
+        sp_release(cluster, target - cluster);
+      else
+        target++;
+    }
+  free(childNext);
+  free(childHead);
+  childHead = childNext = NULL;
+  free(traced);
+  free(growing);
+  free(selected);
+  free(order);
+  free(whole);
+  free(planUsable);
+  planUsable = NULL;
+
+  if (pl_dumpFile && pl_dump(pl_dumpFile))
+    error(0,_("Can't write plan file: %s"), pl_dumpFile);
+  return 0;
+}
+
+/** The function frees memory used by the plan */
+void pl_free()
+{
+  free(planMark);
+  free(planSource);
+  free(planTarget);
+  planMark = NULL;
+  planSource = planTarget = NULL;
+}
+
+/** The function finds the end of the chain of moves that contains cluster 'dest' (the data are moved into it).
+ *  @param dest cluster into which some data are moved
+ *  @param cycle[output] 1 if the chain is cycle, 0 if it is path
+ *  @return the last cluster of the path (it is free), or 'dest' if the chain is cycle.
+ */
+unsigned long pl_chainEnd(unsigned long dest, int *cycle)
+{
+  unsigned long cluster = dest;
+
+  while (planTarget[cluster] && (planTarget[cluster] != dest))
+    cluster = planTarget[cluster];
+  *cycle = (planTarget[cluster] == dest) ? 1 : 0;
+  return (*cycle) ? dest : cluster;
+}
+
+/** The function gives out next chain of moves that was not given out yet. Chains are found in the order of their
+ *  destination clusters. The chain is applied from its end: data of planSource[end] are moved into end, then data
+ *  of planSource[planSource[end]] into planSource[end], etc. until the beginning of the path (it has no source) or
+ *  until the cycle is closed (the source is the end again).
+ *  @param from[input/output] cluster from where the chains should be searched; it is moved behind the found one
+ *  @param cycle[output] 1 if the chain is cycle, 0 if it is path
+ *  @return the end of the chain or 0 if there are no more chains
+ */
+unsigned long pl_nextChain(unsigned long *from, int *cycle)
+{
+  unsigned long dest, end, cluster;
+
+  for (dest = *from; dest <= info.clusterCount; dest++) {
+    if (!planSource[dest] || (planMark[dest] == PL_DONE)) continue;
+    end = pl_chainEnd(dest, cycle);
+    cluster = end;
+    do {
+      planMark[cluster] = PL_DONE;
+      cluster = planSource[cluster];
+    } while (cluster && (cluster != end));
+    *from = dest + 1;
+    return end;
+  }
+  *from = dest;
+  return 0;
+}
+
+/** The function prints chains of moves of the plan (in the order in which the data flow) or only a summary of the
+ *  plan. Chains are not given out by this function.
+ *  @param stream where the plan should be printed
+ *  @param chains 1 if all the chains should be printed, 0 for the summary only
+ */
+void pl_write(FILE *stream, int chains)
+{
+  unsigned long dest, end, head, cluster, length;
+  unsigned long paths = 0, cycles = 0, longest = 0, readRuns = 0, writeRuns = 0;
+  unsigned long clusterSize = bpb.BPB_SecPerClus * info.BPSector;
+  unsigned char *seen;
+  int cycle;
+
+  if ((seen = (unsigned char *)calloc(info.clusterCount + 1, sizeof(unsigned char))) == NULL)
+    error(0,_("Out of memory !"));
+
+  for (dest = 2; dest <= info.clusterCount; dest++) {
+    /* reads and writes of continuous runs can be done at once */
+    if (planTarget[dest] && ((dest == 2) || !planTarget[dest - 1])) readRuns++;
+    if (planSource[dest] && ((dest == 2) || !planSource[dest - 1])) writeRuns++;
+
+    if (!planSource[dest] || seen[dest]) continue;
+    end = pl_chainEnd(dest, &cycle);
+    seen[end] = 1;
+    for (head = end, length = 1; planSource[head] && (planSource[head] != end); head = planSource[head], length++)
+      seen[planSource[head]] = 1;
+    if (cycle) cycles++;
+    else paths++;
+    if (length > longest) longest = length;
+    if (!chains) continue;
+
+    fprintf(stream, (cycle) ? "cycle:" : "path:");
+    for (cluster = head; ; cluster = planTarget[cluster]) {
+      fprintf(stream, " 0x%lx", cluster);
+      if (cluster == end) break;
+      fprintf(stream, " ->");
+    }
+    if (cycle) fprintf(stream, " -> 0x%lx", head);
+    fprintf(stream, "\n");
+  }
+  free(seen);
+
+  fprintf(stream, _("Plan: %lu clusters to move (%.2f MB to read and to write)\n"), planMoves,
+          (double)planMoves * clusterSize / (1024.0 * 1024.0));
+  fprintf(stream, _("Plan: %lu paths, %lu cycles, the longest chain has %lu clusters\n"), paths, cycles, longest);
+  fprintf(stream, _("Plan: %lu continuous reads, %lu continuous writes\n"), readRuns, writeRuns);
+  if (pl_orderOnly)
+    fprintf(stream, _("Plan: %lu items reordered\n"), planReordered);
+  if (pl_traceFile && !pl_selective && !pl_orderOnly)
+    fprintf(stream, _("Plan: %lu items of the access trace placed first (%lu clusters), %lu lines skipped\n"),
+            planTraced, planTraceClusters, planTraceMissing);
+  if (planGaps)
+    fprintf(stream, _("Plan: %lu gaps with %lu clusters left for growing files and directories\n"), planGaps,
+            planSlack);
+  if (pl_selective)
+    fprintf(stream, _("Plan: %lu items selected, %lu of them not placed (no free extent is large enough)\n"),
+            planSelected, planSkipped);
+}
+
+/** The function prints summary of the plan (number of moves, chains, estimated I/O).
+ *  In debug mode all the chains are printed, too.
+ *  @param stream where the plan should be printed
+ */
+void pl_print(FILE *stream)
+{
+  pl_write(stream, debug_mode);
+}
+
+/** The function writes whole plan (all chains of moves and the summary) into a file.
+ *  @param filename name of the file
+ *  @return It returns 0 if there was no error.
+ */
+int pl_dump(const char *filename)
+{
+  FILE *f;
+
+  if ((f = fopen(filename, "w")) == NULL)
+    return 1;
+  pl_write(f, 1);
+  fclose(f);
+  return 0;
+}
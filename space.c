@@ -0,0 +1,381 @@
+/**
+ * @file space.c
+ *
+ * @brief Module keeps the index of free extents (continuous runs of free clusters)
+ *
+ * The index is built from the bitmap of free clusters when the FAT is mounted and it is kept in sync by f32_writeFAT
+ * (sp_allocate and sp_release are called when a cluster becomes used or free). Every free extent is a node of two
+ * treaps (randomized binary search trees):
+ *
+ * - position tree - ordered by the first cluster of the extent; each node holds also the maximal length of extents in
+ *   its subtree, so the first extent of at least N clusters can be found without visiting smaller extents,
+ * - size tree - ordered by the length (and the first cluster) of the extent; it answers best-fit and largest extent
+ *   queries.
+ *
+ * All the queries and updates take logarithmic time in the number of free extents.
+ */
+
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <libintl.h>
+#include <locale.h>
+
+#include <entry.h>
+#include <fat32.h>
+#include <space.h>
+
+/** Free extent, node of both trees; nodes are referenced by index into spNodes (0 means no node) */
+typedef struct {
+  unsigned long start;		/* first cluster of the extent */
+  unsigned long length;		/* number of clusters of the extent */
+  unsigned long maxLength;	/* maximal length of an extent in the subtree of position tree */
+  unsigned long priority;	/* random priority of the node (heap order of both treaps) */
+  unsigned long posLeft, posRight;	/* children in position tree */
+  unsigned long sizeLeft, sizeRight;	/* children in size tree */
+} sp_Node;
+
+/** pool of the nodes; the node 0 is not used */
+static sp_Node *spNodes = NULL;
+/** allocated size of the pool (in nodes) */
+static unsigned long spSize = 0;
+/** number of used nodes of the pool (including the removed ones that are in the list of free nodes) */
+static unsigned long spUsed = 0;
+/** list of removed nodes (linked by posLeft) */
+static unsigned long spUnused = 0;
+/** roots of the trees */
+static unsigned long spPosRoot = 0, spSizeRoot = 0;
+/** state of the random generator of priorities */
+static unsigned long spSeed = 2463534242UL;
+
+/** number of free extents */
+unsigned long spExtentCount = 0;
+/** number of free clusters */
+unsigned long spFreeClusters = 0;
+
+/** The function returns next pseudo-random number (xorshift generator) */
+static unsigned long sp_random()
+{
+  spSeed ^= spSeed << 13;
+  spSeed ^= spSeed >> 17;
+  spSeed ^= spSeed << 5;
+  return spSeed;
+}
+
+/** The function gets a node from the pool (the pool is doubled if it is full) */
+static unsigned long sp_newNode(unsigned long start, unsigned long length)
+{
+  unsigned long n;
+
+  if (spUnused) {
+    n = spUnused;
+    spUnused = spNodes[n].posLeft;
+  } else {
+    if (spUsed + 1 >= spSize) {
+      spSize = (spSize) ? spSize * 2 : 1024;
+      if ((spNodes = (sp_Node *)realloc(spNodes, spSize * sizeof(sp_Node))) == NULL)
+        error(0, _("Out of memory !"));
+    }
+    n = ++spUsed;
+  }
+  spNodes[n].start = start;
+  spNodes[n].length = spNodes[n].maxLength = length;
+  spNodes[n].priority = sp_random();
+  spNodes[n].posLeft = spNodes[n].posRight = spNodes[n].sizeLeft = spNodes[n].sizeRight = 0;
+  return n;
+}
+
+/** The function recomputes maximal length in the subtree of the node in position tree */
+static void sp_update(unsigned long n)
+{
+  unsigned long max = spNodes[n].length;
+
+  if (spNodes[n].posLeft && (spNodes[spNodes[n].posLeft].maxLength > max))
+    max = spNodes[spNodes[n].posLeft].maxLength;
+  if (spNodes[n].posRight && (spNodes[spNodes[n].posRight].maxLength > max))
+    max = spNodes[spNodes[n].posRight].maxLength;
+  spNodes[n].maxLength = max;
+}
+
+/** The function splits position tree into extents that start before the cluster (left) and the others (right) */
+static void sp_posSplit(unsigned long t, unsigned long start, unsigned long *left, unsigned long *right)
+{
+  if (!t) { *left = *right = 0; return; }
+  if (spNodes[t].start < start) {
+    sp_posSplit(spNodes[t].posRight, start, &spNodes[t].posRight, right);
+    *left = t;
+  } else {
+    sp_posSplit(spNodes[t].posLeft, start, left, &spNodes[t].posLeft);
+    *right = t;
+  }
+  sp_update(t);
+}
+
+/** The function joins two position trees; all the extents of the left one precede extents of the right one */
+static unsigned long sp_posMerge(unsigned long left, unsigned long right)
+{
+  if (!left) return right;
+  if (!right) return left;
+  if (spNodes[left].priority > spNodes[right].priority) {
+    spNodes[left].posRight = sp_posMerge(spNodes[left].posRight, right);
+    sp_update(left);
+    return left;
+  }
+  spNodes[right].posLeft = sp_posMerge(left, spNodes[right].posLeft);
+  sp_update(right);
+  return right;
+}
+
+/** The function compares the order of two nodes in size tree (by length, then by the first cluster) */
+static int sp_sizeLess(unsigned long a, unsigned long b)
+{
+  if (spNodes[a].length != spNodes[b].length)
+    return spNodes[a].length < spNodes[b].length;
+  return spNodes[a].start < spNodes[b].start;
+}
+
+/** The function splits size tree into nodes that precede the node n (left) and the others (right) */
+static void sp_sizeSplit(unsigned long t, unsigned long n, unsigned long *left, unsigned long *right)
+{
+  if (!t) { *left = *right = 0; return; }
+  if (sp_sizeLess(t, n)) {
+    sp_sizeSplit(spNodes[t].sizeRight, n, &spNodes[t].sizeRight, right);
+    *left = t;
+  } else {
+    sp_sizeSplit(spNodes[t].sizeLeft, n, left, &spNodes[t].sizeLeft);
+    *right = t;
+  }
+}
+
+/** The function joins two size trees; all the nodes of the left one precede nodes of the right one */
+static unsigned long sp_sizeMerge(unsigned long left, unsigned long right)
+{
+  if (!left) return right;
+  if (!right) return left;
+  if (spNodes[left].priority > spNodes[right].priority) {
+    spNodes[left].sizeRight = sp_sizeMerge(spNodes[left].sizeRight, right);
+    return left;
+  }
+  spNodes[right].sizeLeft = sp_sizeMerge(left, spNodes[right].sizeLeft);
+  return right;
+}
+
+/** The function inserts a new free extent into both trees */
+static void sp_insert(unsigned long start, unsigned long length)
+{
+  unsigned long n = sp_newNode(start, length), left, right;
+
+  sp_posSplit(spPosRoot, start, &left, &right);
+  spPosRoot = sp_posMerge(sp_posMerge(left, n), right);
+  sp_sizeSplit(spSizeRoot, n, &left, &right);
+  spSizeRoot = sp_sizeMerge(sp_sizeMerge(left, n), right);
+  spExtentCount++;
+  spFreeClusters += length;
+}
+
+/** The function removes the node n from position tree t
+ *  @return new root of the tree */
+static unsigned long sp_posErase(unsigned long t, unsigned long n)
+{
+  if (t == n)
+    return sp_posMerge(spNodes[n].posLeft, spNodes[n].posRight);
+  if (spNodes[n].start < spNodes[t].start)
+    spNodes[t].posLeft = sp_posErase(spNodes[t].posLeft, n);
+  else
+    spNodes[t].posRight = sp_posErase(spNodes[t].posRight, n);
+  sp_update(t);
+  return t;
+}
+
+/** The function removes the node n from size tree t
+ *  @return new root of the tree */
+static unsigned long sp_sizeErase(unsigned long t, unsigned long n)
+{
+  if (t == n)
+    return sp_sizeMerge(spNodes[n].sizeLeft, spNodes[n].sizeRight);
+  if (sp_sizeLess(n, t))
+    spNodes[t].sizeLeft = sp_sizeErase(spNodes[t].sizeLeft, n);
+  else
+    spNodes[t].sizeRight = sp_sizeErase(spNodes[t].sizeRight, n);
+  return t;
+}
+
+/** The function removes the node from both trees and returns it into the pool */
+static void sp_remove(unsigned long n)
+{
+  spPosRoot = sp_posErase(spPosRoot, n);
+  spSizeRoot = sp_sizeErase(spSizeRoot, n);
+  spExtentCount--;
+  spFreeClusters -= spNodes[n].length;
+  spNodes[n].posLeft = spUnused;
+  spUnused = n;
+}
+
+/** The function finds the free extent that starts at the cluster or before it (the last such one)
+ *  @return the node or 0 if there is none */
+static unsigned long sp_findBefore(unsigned long cluster)
+{
+  unsigned long t = spPosRoot, found = 0;
+
+  while (t) {
+    if (spNodes[t].start <= cluster) {
+      found = t;
+      t = spNodes[t].posRight;
+    } else
+      t = spNodes[t].posLeft;
+  }
+  return found;
+}
+
+/** The function finds the first extent (in position tree t) that starts after the cluster and has at least length
+ *  clusters; subtrees without such long extent are skipped.
+ *  @return the node or 0 if there is none */
+static unsigned long sp_findAfter(unsigned long t, unsigned long from, unsigned long length)
+{
+  unsigned long n;
+
+  while (t && (spNodes[t].maxLength >= length)) {
+    if (spNodes[t].start > from) {
+      if ((n = sp_findAfter(spNodes[t].posLeft, from, length)))
+        return n;
+      if (spNodes[t].length >= length)
+        return t;
+    }
+    t = spNodes[t].posRight;
+  }
+  return 0;
+}
+
+/** The function builds the index of free extents from the bitmap of free clusters (FATfree). */
+void sp_build()
+{
+  unsigned long cluster, end;
+
+  sp_free();
+  for (cluster = f32_nextBit(FATfree, 2); cluster; cluster = f32_nextBit(FATfree, end)) {
+    for (end = cluster + 1; (end <= info.clusterCount) &&
+         ((FATfree[end / F32_WORD_BITS] >> (end % F32_WORD_BITS)) & 1); end++)
+      ;
+    sp_insert(cluster, end - cluster);
+  }
+}
+
+/** The function frees memory used by the index */
+void sp_free()
+{
+  free(spNodes);
+  spNodes = NULL;
+  spSize = spUsed = spUnused = 0;
+  spPosRoot = spSizeRoot = 0;
+  spExtentCount = spFreeClusters = 0;
+}
+
+/** The function removes the clusters from the free space (they become used). The clusters have to be free.
+ *  @param start the first cluster
+ *  @param length number of clusters
+ */
+void sp_allocate(unsigned long start, unsigned long length)
+{
+  unsigned long n, extStart, extEnd;
+
+  if (!spNodes) return;
+  n = sp_findBefore(start);
+  if (!n || (spNodes[n].start + spNodes[n].length < start + length))
+    error(0, _("Allocating cluster that is not free (0x%lx) !"), start);
+  extStart = spNodes[n].start;
+  extEnd = extStart + spNodes[n].length;
+  sp_remove(n);
+  if (extStart < start)
+    sp_insert(extStart, start - extStart);
+  if (start + length < extEnd)
+    sp_insert(start + length, extEnd - start - length);
+}
+
+/** The function adds the clusters into the free space; neighbouring free extents are joined.
+ *  @param start the first cluster
+ *  @param length number of clusters
+ */
+void sp_release(unsigned long start, unsigned long length)
+{
+  unsigned long n;
+
+  if (!spNodes) return;
+  /* the extent that ends just before the clusters */
+  if ((n = sp_findBefore(start)) && (spNodes[n].start + spNodes[n].length == start)) {
+    length += spNodes[n].length;
+    start = spNodes[n].start;
+    sp_remove(n);
+  }
+  /* the extent that starts just after the clusters */
+  if ((n = sp_findBefore(start + length)) && (spNodes[n].start == start + length)) {
+    length += spNodes[n].length;
+    sp_remove(n);
+  }
+  sp_insert(start, length);
+}
+
+/** First-fit query: the function finds the first run of length free clusters that starts at the cluster 'from' or
+ *  after it.
+ *  @param length number of clusters
+ *  @param from from where we should start to search
+ *  @return the first cluster of the run, or 0 if there is none
+ */
+unsigned long sp_firstFit(unsigned long length, unsigned long from)
+{
+  unsigned long n;
+
+  if (!length) return 0;
+  /* the extent that contains the cluster 'from' */
+  if ((n = sp_findBefore(from)) && (spNodes[n].start + spNodes[n].length >= from + length))
+    return from;
+  return ((n = sp_findAfter(spPosRoot, from, length))) ? spNodes[n].start : 0;
+}
+
+/** Best-fit query: the function finds the shortest free extent that has at least length clusters (the first one of
+ *  them if there are more).
+ *  @param length number of clusters
+ *  @return the first cluster of the extent, or 0 if there is none
+ */
+unsigned long sp_bestFit(unsigned long length)
+{
+  unsigned long t = spSizeRoot, found = 0;
+
+  while (t) {
+    if (spNodes[t].length >= length) {
+      found = t;
+      t = spNodes[t].sizeLeft;
+    } else
+      t = spNodes[t].sizeRight;
+  }
+  return (found) ? spNodes[found].start : 0;
+}
+
+/** The function finds the largest free extent (the last one of them if there are more).
+ *  @param length[output] length of the extent (0 if there is no free cluster)
+ *  @return the first cluster of the extent, or 0 if there is none
+ */
+unsigned long sp_largest(unsigned long *length)
+{
+  unsigned long t = spSizeRoot;
+
+  *length = 0;
+  if (!t) return 0;
+  while (spNodes[t].sizeRight)
+    t = spNodes[t].sizeRight;
+  *length = spNodes[t].length;
+  return spNodes[t].start;
+}